@@ -0,0 +1,97 @@
+#!/bin/sh
+# Runs two remote-bootselect instances with -ha in network namespaces on a shared bridge,
+# checks that every client is answered by exactly one instance,
+# then stops one instance and checks that the other takes over. Exits 1 if a check fails.
+# usage: sudo ./run-ha-netns.sh [path/to/remote-bootselect]
+BIN="$(realpath "${1:-build/remote-bootselect}")"
+HEARTBEAT_MS=200
+TMP="$(mktemp -d)"
+
+cleanup() {
+    kill $PID_A $PID_B 2>/dev/null
+    for ns in rbs-a rbs-b rbs-client rbs-bridge; do
+        ip netns del $ns 2>/dev/null
+    done
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+ip netns add rbs-bridge
+ip -n rbs-bridge link add br0 type bridge
+ip -n rbs-bridge link set br0 up
+for ns in rbs-a rbs-b rbs-client; do
+    ip netns add $ns
+    ip -n $ns link add eth0 type veth peer name $ns netns rbs-bridge
+    ip -n $ns link set eth0 up
+    ip -n rbs-bridge link set $ns master br0 up
+done
+
+for i in $(seq 0 63); do
+    printf '0a:1b:2c:3d:4e:%02x entry%d\n' $i $i
+done > "$TMP/config"
+
+ip netns exec rbs-a "$BIN" -i eth0 -c "$TMP/config" -sock "$TMP/a.sock" -suppress 0 -ha $HEARTBEAT_MS > "$TMP/a.log" 2>&1 &
+PID_A=$!
+ip netns exec rbs-b "$BIN" -i eth0 -c "$TMP/config" -sock "$TMP/b.sock" -suppress 0 -ha $HEARTBEAT_MS > "$TMP/b.log" 2>&1 &
+PID_B=$!
+sleep 1
+
+# sends one broadcast request per client and prints: answered_once answered_more unanswered per_server_counts
+probe() {
+    ip netns exec rbs-client python3 - <<'PY'
+import socket, struct, time, collections
+s = socket.socket(socket.AF_PACKET, socket.SOCK_RAW, socket.htons(0x7184))
+s.bind(("eth0", 0))
+s.settimeout(0.05)
+once = twice = missing = 0
+servers = collections.Counter()
+for i in range(64):
+    mac = bytes([0x0a, 0x1b, 0x2c, 0x3d, 0x4e, i])
+    s.send(b"\xff" * 6 + mac + struct.pack("!H", 0x7184) + b"\0" * 46)
+    replies = []
+    try:
+        while True:
+            frame, addr = s.recvfrom(2000)
+            if frame[0:6] == mac and addr[2] != socket.PACKET_OUTGOING:
+                replies.append(frame[6:12].hex(":"))
+    except socket.timeout:
+        pass
+    servers.update(replies)
+    if len(replies) == 1:
+        once += 1
+    elif len(replies) == 0:
+        missing += 1
+    else:
+        twice += 1
+print(once, twice, missing, " ".join(f"{mac}={count}" for mac, count in sorted(servers.items())))
+PY
+}
+
+FAILED=0
+# usage: check description expected_servers
+check() {
+    set -- "$1" "$2" $RESULT
+    echo "$1: $RESULT"
+    if [ "$3" -ne 64 ] || [ "$4" -ne 0 ] || [ "$5" -ne 0 ] || [ $(($# - 5)) -ne "$2" ]; then
+        echo "FAIL: $1: expected every client to be answered exactly once by $2 instance(s)"
+        FAILED=1
+    fi
+}
+
+MAC_B="$(ip netns exec rbs-b cat /sys/class/net/eth0/address)"
+
+RESULT="$(probe)"
+check "both instances up" 2
+
+kill $PID_A
+# one heartbeat interval and some slack
+sleep 0.3
+RESULT="$(probe)"
+check "after stopping instance a" 1
+case "$RESULT" in
+*"$MAC_B=64"*) ;;
+*) echo "FAIL: the clients of instance a did not move to instance b"; FAILED=1 ;;
+esac
+
+[ $FAILED -eq 0 ] && echo "PASS"
+exit $FAILED
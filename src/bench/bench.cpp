@@ -0,0 +1,274 @@
+#include "src/server/ConfigHandler.hpp"
+#include "src/server/EventHandler.hpp"
+#include "src/server/MQTTHandler.hpp"
+#include "src/server/PrefixTable.hpp"
+#include "src/server/RequestHandler.hpp"
+#include "src/server/common.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <json.hpp>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+#include <vector>
+
+// Microbenchmarks for the parsing and lookup primitives of the server.
+// Usage: remote-bootselect-bench [-o results.json] [-baseline old_results.json] [-filter name]
+// Every case is run for at least MIN_SAMPLE_TIME per sample, the median and minimum ns/op of SAMPLES samples are reported.
+// With -baseline, the ratio to the matching case of an earlier run is printed, so results of two commits can be compared.
+
+using json = nlohmann::json;
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr auto MIN_SAMPLE_TIME = std::chrono::milliseconds(50);
+static constexpr size_t SAMPLES = 5;
+
+template <typename T> inline void keep(T const& value) { asm volatile("" : : "r,m"(value) : "memory"); }
+
+struct Bench {
+    json results = json::array();
+    json baseline = json::array();
+    std::string filter;
+
+    void run(std::string const& name, size_t size, std::function<void()> const& op) {
+        if (!filter.empty() && name.find(filter) == std::string::npos) return;
+        // find an iteration count that takes at least MIN_SAMPLE_TIME
+        size_t iterations = 1;
+        while (true) {
+            auto start = bench_clock::now();
+            for (size_t i = 0; i < iterations; ++i) op();
+            if (bench_clock::now() - start >= MIN_SAMPLE_TIME) break;
+            iterations *= 2;
+        }
+        std::vector<double> samples;
+        for (size_t s = 0; s < SAMPLES; ++s) {
+            auto start = bench_clock::now();
+            for (size_t i = 0; i < iterations; ++i) op();
+            std::chrono::duration<double, std::nano> elapsed = bench_clock::now() - start;
+            samples.push_back(elapsed.count() / iterations);
+        }
+        std::sort(samples.begin(), samples.end());
+        json result = {
+            {"name",       name                 },
+            {"size",       size                 },
+            {"iterations", iterations           },
+            {"median_ns",  samples[SAMPLES / 2] },
+            {"min_ns",     samples[0]           },
+        };
+        results.push_back(result);
+
+        std::cout << name << "/" << size << ": " << samples[SAMPLES / 2] << " ns/op";
+        for (auto const& old : baseline) {
+            if (old["name"] == name && old["size"] == size) {
+                std::cout << " (" << samples[SAMPLES / 2] / old["median_ns"].get<double>() << "x baseline)";
+            }
+        }
+        std::cout << std::endl;
+    }
+};
+
+static std::mt19937_64 rng(7184);
+
+static MAC random_mac() {
+    MAC mac;
+    uint64_t r = rng();
+    std::memcpy(mac.data(), &r, mac.size());
+    return mac;
+}
+
+static std::string format_mac(MAC const& mac) {
+    char str[18];
+    snprintf(str, sizeof(str), "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return str;
+}
+
+static std::string make_config(size_t lines) {
+    std::string config;
+    for (size_t i = 0; i < lines; ++i) {
+        config += format_mac(random_mac()) + " entry_" + std::to_string(i) + "\n";
+    }
+    return config;
+}
+
+static std::unordered_map<std::string, std::string> make_menuentries(size_t count) {
+    std::unordered_map<std::string, std::string> menuentries;
+    for (size_t i = 0; i < count; ++i) {
+        menuentries["gnulinux-" + std::to_string(i)] = "Linux " + std::to_string(i);
+    }
+    return menuentries;
+}
+
+static std::vector<unsigned char> make_export_frame(std::unordered_map<std::string, std::string> const& menuentries) {
+    std::vector<unsigned char> frame(sizeof(ethhdr));
+    for (auto const& [id, title] : menuentries) {
+        frame.insert(frame.end(), id.begin(), id.end());
+        frame.push_back('\0');
+        frame.insert(frame.end(), title.begin(), title.end());
+        frame.push_back('\0');
+    }
+    return frame;
+}
+
+static void bench_parse_mac(Bench& bench) {
+    for (size_t count : {1, 1000}) {
+        std::string input;
+        for (size_t i = 0; i < count; ++i) {
+            input += format_mac(random_mac()) + " ";
+        }
+        bench.run("parse_mac", count, [&]() {
+            std::stringstream stream(input);
+            MAC mac;
+            for (size_t i = 0; i < count; ++i) {
+                parse_mac(stream, mac);
+                keep(mac);
+            }
+        });
+    }
+}
+
+static void bench_process_config(Bench& bench) {
+    EpollEventHandler eventHandler;
+    ConfigHandler configHandler(eventHandler, "/tmp/remote-bootselect-bench-" + std::to_string(getpid()) + ".sock");
+    for (size_t lines : {100, 10000, 100000}) {
+        std::string config = make_config(lines);
+        bench.run("process_config", lines, [&]() {
+            std::stringstream stream(config);
+            configHandler.process_config(stream, false);
+        });
+        defaultEntries.clear();
+    }
+    unlink(("/tmp/remote-bootselect-bench-" + std::to_string(getpid()) + ".sock").c_str());
+}
+
+static void bench_menuentries(Bench& bench) {
+    for (size_t count : {4, 16, 64}) {
+        auto frame = make_export_frame(make_menuentries(count));
+        bench.run("read_strnlen", count, [&]() {
+            const char* str = reinterpret_cast<const char*>(frame.data()) + sizeof(ethhdr);
+            int remaining_len = frame.size() - sizeof(ethhdr);
+            for (size_t i = 0; i < count * 2; ++i) {
+                keep(read_strnlen(str, remaining_len));
+            }
+        });
+        bench.run("process_menuentries", count, [&]() {
+            std::unordered_map<std::string, std::string> menuentries;
+            parse_menuentries(frame.data(), frame.size(), menuentries);
+            keep(menuentries);
+        });
+    }
+}
+
+static void bench_lookup(Bench& bench) {
+    std::vector<MAC> macs(1024);
+    for (MAC& mac : macs) mac = random_mac();
+    bench.run("hash_mac", macs.size(), [&]() {
+        for (MAC const& mac : macs) keep(std::hash<MAC>{}(mac));
+    });
+
+    for (size_t size : {16, 1024, 65536}) {
+        defaultEntries.clear();
+        std::vector<MAC> present;
+        for (size_t i = 0; i < size; ++i) {
+            MAC mac = random_mac();
+            defaultEntries[mac] = "entry";
+            present.push_back(mac);
+        }
+        std::vector<MAC> hits(1024);
+        for (MAC& mac : hits) mac = present[rng() % present.size()];
+        bench.run("find_entry_exact_hit", size, [&]() {
+            for (MAC const& mac : hits) keep(find_entry(mac));
+        });
+        bench.run("find_entry_miss", size, [&]() {
+            for (MAC const& mac : macs) keep(find_entry(mac));
+        });
+    }
+    defaultEntries.clear();
+
+    for (size_t rules : {16, 256, 4096}) {
+        PrefixTable table;
+        std::vector<std::pair<MAC, MAC>> ranges;
+        std::vector<MAC> hits;
+        for (size_t i = 0; i < rules; ++i) {
+            MAC first = random_mac();
+            uint8_t length = 24 + rng() % 21;
+            MAC last = first;
+            for (size_t b = length / 8; b < last.size(); ++b) {
+                first[b] &= b == length / 8 ? ~(0xff >> (length % 8)) : 0;
+                last[b] |= b == length / 8 ? (0xff >> (length % 8)) : 0xff;
+            }
+            table.insert(first, last, "entry");
+            ranges.push_back({first, last});
+            hits.push_back(last);
+        }
+        table.build();
+        bench.run("prefix_find", rules, [&]() {
+            for (size_t i = 0; i < 1024; ++i) keep(table.find(hits[i % hits.size()]));
+        });
+        bench.run("prefix_load", rules, [&]() {
+            PrefixTable loaded;
+            for (auto const& [first, last] : ranges) loaded.insert(first, last, "entry");
+            loaded.build();
+            keep(loaded.size());
+        });
+    }
+}
+
+static void bench_build_reply(Bench& bench) {
+    ethhdr request = {};
+    std::memset(request.h_dest, 0xff, sizeof(request.h_dest));
+    MAC client = random_mac();
+    std::memcpy(request.h_source, client.data(), client.size());
+    MAC hwaddr = random_mac();
+    for (size_t length : {8, 64, 255}) {
+        std::string entry(length, 'x');
+        bench.run("build_reply", length, [&]() {
+            DataFrame reply;
+            keep(build_reply(request, hwaddr, entry, reply));
+            keep(reply);
+        });
+    }
+}
+
+static void bench_discovery(Bench& bench) {
+    MAC mac = random_mac();
+    for (size_t count : {4, 16, 64}) {
+        auto menuentries = make_menuentries(count);
+        bench.run("upload_menuentries", count, [&]() { keep(MQTTHandler::discovery_payload(mac, menuentries)); });
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Bench bench;
+    std::string output;
+    for (int i = 1; i + 1 < argc; i++) {
+        std::string const& arg = argv[i];
+        if (arg.compare("-o") == 0) {
+            output = argv[++i];
+        } else if (arg.compare("-baseline") == 0) {
+            std::ifstream baseline(argv[++i]);
+            if (baseline.is_open()) {
+                bench.baseline = json::parse(baseline)["results"];
+            } else {
+                std::cout << "warning: failed to open baseline: " << argv[i] << std::endl;
+            }
+        } else if (arg.compare("-filter") == 0) {
+            bench.filter = argv[++i];
+        }
+    }
+
+    bench_parse_mac(bench);
+    bench_process_config(bench);
+    bench_menuentries(bench);
+    bench_lookup(bench);
+    bench_build_reply(bench);
+    bench_discovery(bench);
+
+    if (output.size() > 0) {
+        std::ofstream out(output);
+        out << json{{"results", bench.results}}.dump(2) << std::endl;
+    }
+}
@@ -14,6 +14,12 @@
 #define atoi_1(p) (*(p) - '0')
 
 #define BOOTSELECT_ETHERTYPE 0x7184
+// first data byte of a request that carries the menu entries, as in an export
+#define BOOTSELECT_COMBINED 0x01
+
+#define BROADCAST_TIMEOUT_MS 1000
+// a cached server that does not answer within this is assumed to be down
+#define UNICAST_TIMEOUT_MS 200
 
 struct __attribute__((packed)) etherhdr {
     grub_uint8_t dst[6];
@@ -28,10 +34,30 @@ static const grub_uint8_t ether_broadcast_addr[] = {0xff, 0xff, 0xff, 0xff, 0xff
 // compatible
 GRUB_MOD_LICENSE("GPLv3+");
 
-static struct grub_net_card *get_card(int card_idx) {
+static bool load_cards(void) {
     grub_dl_load("efinet");
     if (grub_net_cards == NULL) {
         grub_printf("Failed to find any network cards.\n");
+        return false;
+    }
+    return true;
+}
+
+static grub_err_t open_card(struct grub_net_card *card) {
+    grub_err_t err;
+    if (!card->opened) {
+        err = GRUB_ERR_NONE;
+        if (card->driver->open)
+            err = card->driver->open(card);
+        if (err)
+            return err;
+        card->opened = 1;
+    }
+    return GRUB_ERR_NONE;
+}
+
+static struct grub_net_card *get_card(int card_idx) {
+    if (!load_cards()) {
         return NULL;
     }
 
@@ -51,14 +77,8 @@ static struct grub_net_card *get_card(int card_idx) {
         return NULL;
     }
 
-    grub_err_t err;
-    if (!card->opened) {
-        err = GRUB_ERR_NONE;
-        if (card->driver->open)
-            err = card->driver->open(card);
-        if (err)
-            return NULL;
-        card->opened = 1;
+    if (open_card(card) != GRUB_ERR_NONE) {
+        return NULL;
     }
     return card;
 }
@@ -81,15 +101,78 @@ static void *netbuff_get(struct grub_net_buff *nb, grub_size_t size) {
     }
 }
 
-static grub_err_t append_etherhdr(struct grub_net_buff *nb, struct grub_net_card *card) {
+static grub_err_t append_etherhdr(struct grub_net_buff *nb, struct grub_net_card *card, const grub_uint8_t *dst) {
     grub_uint16_t ethertype = grub_cpu_to_be16(BOOTSELECT_ETHERTYPE);
     struct etherhdr hdr;
-    grub_memcpy(hdr.dst, ether_broadcast_addr, 6);
+    grub_memcpy(hdr.dst, dst, 6);
     grub_memcpy(hdr.src, &card->default_address.mac, 6);
     hdr.type = ethertype;
     return netbuff_append(nb, &hdr, sizeof(hdr));
 }
 
+static bool export_entry(grub_menu_entry_t entry) {
+    // TODO:
+    // support submenus
+    return entry->id && entry->title && !entry->submenu;
+}
+
+static grub_size_t menu_size(grub_menu_t grub_menu) {
+    grub_size_t totalSize = 0;
+    for (grub_menu_entry_t entry = grub_menu->entry_list; entry != NULL; entry = entry->next) {
+        if (export_entry(entry)) {
+            // + 1 to include \0
+            totalSize += grub_strlen(entry->id) + 1 + grub_strlen(entry->title) + 1;
+        }
+    }
+    return totalSize;
+}
+
+static grub_err_t append_menu(struct grub_net_buff *nb, grub_menu_t grub_menu) {
+    for (grub_menu_entry_t entry = grub_menu->entry_list; entry != NULL; entry = entry->next) {
+        if (!entry->id || !entry->title) {
+            grub_printf("warning: missing id or title on a menuentry\n");
+            continue;
+        }
+        if (!export_entry(entry)) {
+            continue;
+        }
+        // + 1 to include \0
+        grub_err_t err = netbuff_append(nb, entry->id, grub_strlen(entry->id) + 1);
+        if (err == GRUB_ERR_NONE) {
+            err = netbuff_append(nb, entry->title, grub_strlen(entry->title) + 1);
+        }
+        if (err != GRUB_ERR_NONE) {
+            return err;
+        }
+    }
+    return GRUB_ERR_NONE;
+}
+
+// a request for the default entry to dst, which also exports grub_menu unless it is NULL
+static struct grub_net_buff *build_request(struct grub_net_card *card, grub_menu_t grub_menu, const grub_uint8_t *dst) {
+    grub_size_t size = sizeof(struct etherhdr);
+    if (grub_menu != NULL) {
+        size += 1 + menu_size(grub_menu);
+    }
+    struct grub_net_buff *nb = grub_netbuff_alloc(size);
+    if (nb == NULL) {
+        return NULL;
+    }
+    grub_err_t err = append_etherhdr(nb, card, dst);
+    if (err == GRUB_ERR_NONE && grub_menu != NULL) {
+        grub_uint8_t marker = BOOTSELECT_COMBINED;
+        err = netbuff_append(nb, &marker, sizeof(marker));
+        if (err == GRUB_ERR_NONE) {
+            err = append_menu(nb, grub_menu);
+        }
+    }
+    if (err != GRUB_ERR_NONE) {
+        grub_netbuff_free(nb);
+        return NULL;
+    }
+    return nb;
+}
+
 static void flush_recv(struct grub_net_card *card) {
     struct grub_net_buff *flush;
     while ((flush = card->driver->recv(card)) != NULL) {
@@ -97,67 +180,201 @@ static void flush_recv(struct grub_net_card *card) {
     }
 }
 
-static grub_err_t grub_cmd_remote_bootselect(grub_extcmd_context_t cmd __attribute__((unused)), int argc, char **args) {
+// returns the entry of a reply to card and the server that sent it, or NULL if response is not one
+static char *read_reply(struct grub_net_card *card, struct grub_net_buff *response, grub_uint8_t *server) {
     grub_uint16_t ethertype = grub_cpu_to_be16(BOOTSELECT_ETHERTYPE);
+    struct etherhdr response_hdr;
+    void *data = netbuff_get(response, sizeof(response_hdr));
+    if (data == NULL) {
+        return NULL;
+    }
+    response_hdr = *(struct etherhdr *)data;
+    if (response_hdr.type != ethertype || grub_memcmp(response_hdr.dst, &card->default_address.mac, 6) != 0) {
+        return NULL;
+    }
+    grub_uint8_t len;
+    data = netbuff_get(response, sizeof(len));
+    if (data == NULL) {
+        grub_printf("warning: expected length\n");
+        return NULL;
+    }
+    len = *(grub_uint8_t *)data;
+    data = netbuff_get(response, len);
+    if (data == NULL) {
+        grub_printf("warning: expected str of size %d\n", len);
+        return NULL;
+    }
+    char *entry = (char *)grub_malloc(len + 1);
+    if (entry == NULL) {
+        return NULL;
+    }
+    grub_memcpy(entry, data, len);
+    entry[len] = '\0';
+    grub_memcpy(server, response_hdr.src, 6);
+    return entry;
+}
 
-    int card_idx = argc > 0 ? atoi_1(args[0]) : 0;
+// the card that got the reply is reported in remote_bootselect_card,
+// the entry and the server are kept in remote_bootselect_default and remote_bootselect_server for save_env
+static void set_default(struct grub_net_card *card, char *entry, const grub_uint8_t *server) {
+    grub_printf("got default:%s on %s\n", entry, card->name);
+    grub_env_set("default", entry);
+    grub_env_set("remote_bootselect_card", card->name);
+    grub_env_set("remote_bootselect_default", entry);
+    char server_str[18];
+    grub_snprintf(server_str, sizeof(server_str), "%02x:%02x:%02x:%02x:%02x:%02x", server[0], server[1], server[2], server[3], server[4],
+                  server[5]);
+    grub_env_set("remote_bootselect_server", server_str);
+    grub_free(entry);
+}
 
-    struct grub_net_card *card = get_card(card_idx);
-    if (card == NULL) {
-        grub_printf("failed to get card\n");
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// reads the server saved by a previous boot, false if there is none
+static bool cached_server(grub_uint8_t *server) {
+    const char *str = grub_env_get("remote_bootselect_server");
+    if (str == NULL || grub_strlen(str) != 17) {
+        return false;
+    }
+    for (int i = 0; i < 6; ++i) {
+        int high = hex_digit(str[i * 3]);
+        int low = hex_digit(str[i * 3 + 1]);
+        if (high < 0 || low < 0 || (i < 5 && str[i * 3 + 2] != ':')) {
+            return false;
+        }
+        server[i] = high << 4 | low;
+    }
+    return true;
+}
+
+// boots with the entry saved by a previous boot when no server answered
+static grub_err_t use_cached_default(void) {
+    const char *entry = grub_env_get("remote_bootselect_default");
+    if (entry == NULL || *entry == '\0') {
         return 1;
     }
+    grub_printf("using cached default:%s\n", entry);
+    grub_env_set("default", entry);
+    return GRUB_ERR_NONE;
+}
 
-    struct grub_net_buff *nb = grub_netbuff_alloc(sizeof(struct etherhdr));
+struct card_request {
+    struct grub_net_card *card;
+    struct grub_net_buff *nb;
+};
 
-    grub_err_t err = append_etherhdr(nb, card);
-    if (err != GRUB_ERR_NONE) {
-        grub_netbuff_free(nb);
-        return err;
+// sends the request on every card and takes the first reply from any of them,
+// so the time to find the cabled card does not grow with the number of cards
+static grub_err_t remote_bootselect_all(grub_menu_t grub_menu, const grub_uint8_t *dst, grub_uint64_t timeout_ms) {
+    if (!load_cards()) {
+        return 1;
+    }
+
+    struct grub_net_card *card;
+    grub_size_t card_count = 0;
+    FOR_NET_CARDS(card) {
+        ++card_count;
+    }
+    struct card_request *requests = grub_calloc(card_count, sizeof(*requests));
+    if (requests == NULL) {
+        return grub_errno;
+    }
+
+    grub_size_t open_count = 0;
+    FOR_NET_CARDS(card) {
+        if (open_card(card) != GRUB_ERR_NONE) {
+            grub_printf("warning: failed to open card %s\n", card->name);
+            grub_errno = GRUB_ERR_NONE;
+            continue;
+        }
+        struct grub_net_buff *nb = build_request(card, grub_menu, dst);
+        if (nb == NULL) {
+            continue;
+        }
+        flush_recv(card);
+        requests[open_count].card = card;
+        requests[open_count].nb = nb;
+        ++open_count;
+    }
+    if (open_count == 0) {
+        grub_printf("failed to open any card\n");
+    }
+
+    grub_err_t result = 1;
+    grub_uint64_t limit_time = grub_get_time_ms() + timeout_ms;
+    while (open_count > 0 && result != GRUB_ERR_NONE && grub_get_time_ms() < limit_time) {
+        for (grub_size_t i = 0; i < open_count; ++i) {
+            requests[i].card->driver->send(requests[i].card, requests[i].nb);
+        }
+        grub_millisleep(10);
+        // one frame per card and pass, so a card with a lot of other traffic does not starve the rest,
+        // the timeout also ends the draining so a busy segment cannot keep the loop running forever
+        bool received = true;
+        while (received && result != GRUB_ERR_NONE && grub_get_time_ms() < limit_time) {
+            received = false;
+            for (grub_size_t i = 0; i < open_count && result != GRUB_ERR_NONE; ++i) {
+                struct grub_net_buff *response = requests[i].card->driver->recv(requests[i].card);
+                if (response == NULL) {
+                    continue;
+                }
+                received = true;
+                grub_uint8_t server[6];
+                char *entry = read_reply(requests[i].card, response, server);
+                grub_netbuff_free(response);
+                if (entry != NULL) {
+                    set_default(requests[i].card, entry, server);
+                    result = GRUB_ERR_NONE;
+                }
+            }
+        }
+    }
+    if (result != GRUB_ERR_NONE) {
+        grub_printf("timeout waiting for response\n");
+    }
+
+    for (grub_size_t i = 0; i < open_count; ++i) {
+        grub_netbuff_free(requests[i].nb);
+    }
+    grub_free(requests);
+    return result;
+}
+
+static const struct grub_arg_option options[] = {
+    {"export", 'e', 0, N_("Send the menu entries with the request."), 0, 0},
+    {0, 0, 0, 0, 0, 0},
+};
+
+static grub_err_t remote_bootselect_card(struct grub_net_card *card, grub_menu_t grub_menu, const grub_uint8_t *dst,
+                                         grub_uint64_t timeout_ms) {
+    struct grub_net_buff *nb = build_request(card, grub_menu, dst);
+    if (nb == NULL) {
+        return grub_errno;
     }
 
     flush_recv(card);
 
-    const grub_uint64_t timeout_ms = 1000;
     grub_uint64_t limit_time = grub_get_time_ms() + timeout_ms;
     while (grub_get_time_ms() < limit_time) {
         card->driver->send(card, nb);
         grub_millisleep(10);
         struct grub_net_buff *response = card->driver->recv(card);
         if (response) {
-            struct etherhdr response_hdr;
-            void *data = netbuff_get(response, sizeof(response_hdr));
-            if (data == NULL) {
-                grub_netbuff_free(response);
-                continue;
-            }
-            response_hdr = *(struct etherhdr *)data;
-            if (response_hdr.type == ethertype && (grub_memcmp(response_hdr.dst, &card->default_address.mac, 6) == 0)) {
-                grub_uint8_t len;
-                data = netbuff_get(response, sizeof(len));
-                if (data == NULL) {
-                    grub_printf("warning: expected length\n");
-                    grub_netbuff_free(response);
-                    continue;
-                }
-                len = *(grub_uint8_t *)data;
-                data = netbuff_get(response, len);
-                if (data == NULL) {
-                    grub_printf("warning: expected str of size %d\n", len);
-                    grub_netbuff_free(response);
-                    continue;
-                }
-                char *entry = (char *)grub_malloc(len + 1);
-                grub_memcpy(entry, data, len);
-                entry[len] = '\0';
-                grub_printf("got default:%s\n", entry);
-                grub_env_set("default", entry);
-                grub_free(entry);
-                grub_netbuff_free(response);
+            grub_uint8_t server[6];
+            char *entry = read_reply(card, response, server);
+            grub_netbuff_free(response);
+            if (entry != NULL) {
+                set_default(card, entry, server);
                 grub_netbuff_free(nb);
                 return GRUB_ERR_NONE;
             }
-            grub_netbuff_free(response);
         }
     }
     grub_printf("timeout waiting for response\n");
@@ -165,61 +382,101 @@ static grub_err_t grub_cmd_remote_bootselect(grub_extcmd_context_t cmd __attribu
     return 1;
 }
 
-static grub_err_t grub_cmd_remote_bootselect_export(grub_extcmd_context_t cmd __attribute__((unused)), int argc, char **args) {
-    grub_menu_t grub_menu = grub_env_get_menu();
-    if (grub_menu == NULL) {
-        grub_printf("failed to get menu\n");
-        return 1;
+static grub_err_t grub_cmd_remote_bootselect(grub_extcmd_context_t ctxt, int argc, char **args) {
+    // with --export the server gets the menu in the same round-trip,
+    // so this has to run after the menu entries are defined
+    grub_menu_t grub_menu = NULL;
+    if (ctxt->state[0].set) {
+        grub_menu = grub_env_get_menu();
+        if (grub_menu == NULL) {
+            grub_printf("failed to get menu\n");
+            return 1;
+        }
     }
 
-    int card_idx = argc > 0 ? atoi_1(args[0]) : 0;
-
-    struct grub_net_card *card = get_card(card_idx);
-    if (card == NULL) {
-        grub_printf("failed to get card\n");
-        return 1;
+    bool all = argc > 0 && grub_strcmp(args[0], "all") == 0;
+    struct grub_net_card *card = NULL;
+    if (!all) {
+        int card_idx = argc > 0 ? atoi_1(args[0]) : 0;
+        card = get_card(card_idx);
+        if (card == NULL) {
+            grub_printf("failed to get card\n");
+            return use_cached_default();
+        }
     }
 
-    grub_uint64_t totalSize = 0;
-    for (grub_menu_entry_t entry = grub_menu->entry_list; entry != NULL; entry = entry->next) {
-        if (!entry->id || !entry->title || entry->submenu) {
-            continue;
+    // the server that answered the last boot is asked directly first,
+    // if it is down the cached default is used without waiting for the broadcast timeout.
+    // it is forgotten, so the next boot broadcasts and finds a replaced server or another -ha instance
+    grub_uint8_t server[6];
+    if (cached_server(server)) {
+        grub_err_t err = all ? remote_bootselect_all(grub_menu, server, UNICAST_TIMEOUT_MS)
+                             : remote_bootselect_card(card, grub_menu, server, UNICAST_TIMEOUT_MS);
+        if (err == GRUB_ERR_NONE) {
+            return GRUB_ERR_NONE;
         }
-        // + 1 to include \0
-        grub_uint32_t id_len = grub_strlen(entry->id) + 1;
-        grub_uint32_t title_len = grub_strlen(entry->title) + 1;
-        totalSize += id_len + title_len;
+        grub_env_unset("remote_bootselect_server");
+        if (use_cached_default() == GRUB_ERR_NONE) {
+            return GRUB_ERR_NONE;
+        }
+    }
+
+    grub_err_t err = all ? remote_bootselect_all(grub_menu, ether_broadcast_addr, BROADCAST_TIMEOUT_MS)
+                         : remote_bootselect_card(card, grub_menu, ether_broadcast_addr, BROADCAST_TIMEOUT_MS);
+    if (err != GRUB_ERR_NONE) {
+        return use_cached_default();
     }
+    return GRUB_ERR_NONE;
+}
 
-    struct grub_net_buff *nb = grub_netbuff_alloc(sizeof(struct etherhdr) + totalSize);
+static grub_err_t send_menu(grub_menu_t grub_menu, struct grub_net_card *card) {
+    struct grub_net_buff *nb = grub_netbuff_alloc(sizeof(struct etherhdr) + menu_size(grub_menu));
 
-    grub_err_t err = append_etherhdr(nb, card);
+    grub_err_t err = append_etherhdr(nb, card, ether_broadcast_addr);
+    if (err == GRUB_ERR_NONE) {
+        err = append_menu(nb, grub_menu);
+    }
     if (err != GRUB_ERR_NONE) {
         grub_netbuff_free(nb);
         return err;
     }
 
-    for (grub_menu_entry_t entry = grub_menu->entry_list; entry != NULL; entry = entry->next) {
-        if (!entry->id || !entry->title) {
-            grub_printf("warning: missing id or title on a menuentry\n");
-            continue;
+    card->driver->send(card, nb);
+    grub_netbuff_free(nb);
+    return 0;
+}
+
+static grub_err_t grub_cmd_remote_bootselect_export(grub_extcmd_context_t cmd __attribute__((unused)), int argc, char **args) {
+    grub_menu_t grub_menu = grub_env_get_menu();
+    if (grub_menu == NULL) {
+        grub_printf("failed to get menu\n");
+        return 1;
+    }
+
+    if (argc > 0 && grub_strcmp(args[0], "all") == 0) {
+        if (!load_cards()) {
+            return 1;
         }
-        if (entry->submenu) {
-            // TODO:
-            // support submenus
-            continue;
+        struct grub_net_card *card;
+        FOR_NET_CARDS(card) {
+            if (open_card(card) == GRUB_ERR_NONE) {
+                send_menu(grub_menu, card);
+            } else {
+                grub_errno = GRUB_ERR_NONE;
+            }
         }
-        // + 1 to include \0
-        grub_uint32_t id_len = grub_strlen(entry->id) + 1;
-        netbuff_append(nb, entry->id, id_len);
+        return 0;
+    }
+
+    int card_idx = argc > 0 ? atoi_1(args[0]) : 0;
 
-        grub_uint32_t title_len = grub_strlen(entry->title) + 1;
-        netbuff_append(nb, entry->title, title_len);
+    struct grub_net_card *card = get_card(card_idx);
+    if (card == NULL) {
+        grub_printf("failed to get card\n");
+        return 1;
     }
 
-    card->driver->send(card, nb);
-    grub_netbuff_free(nb);
-    return 0;
+    return send_menu(grub_menu, card);
 }
 
 static grub_extcmd_t remote_bootselect_cmd;
@@ -227,7 +484,8 @@ static grub_extcmd_t remote_bootselect_export;
 
 GRUB_MOD_INIT(remote_bootselect) {
     remote_bootselect_cmd =
-        grub_register_extcmd("remote_bootselect", grub_cmd_remote_bootselect, 0, 0, N_("Get the default boot option from the network."), 0);
+        grub_register_extcmd("remote_bootselect", grub_cmd_remote_bootselect, 0, N_("[--export] [n|all]"),
+                             N_("Get the default boot option from the network."), options);
     remote_bootselect_export =
         grub_register_extcmd("remote_bootselect_export", grub_cmd_remote_bootselect_export, 0, 0, N_("Send menu entries to network."), 0);
 }
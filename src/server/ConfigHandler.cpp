@@ -1,5 +1,6 @@
 #include "ConfigHandler.hpp"
 #include "MQTTHandler.hpp"
+#include "PrefixTable.hpp"
 #include "common.hpp"
 #include <arpa/inet.h>
 #include <cstring>
@@ -10,8 +11,10 @@
 #include <sys/un.h>
 #include <unistd.h>
 
-ConfigHandler::ConfigHandler(EventHandler& eventHandler) {
-    create_socket("/tmp/remote-bootselect.sock");
+ConfigHandler::ConfigHandler(EventHandler& eventHandler, std::string const& path, int existing_socket) : config_socket(existing_socket) {
+    if (config_socket == -1) {
+        create_socket(path);
+    }
     if (config_socket != -1) {
         handler = std::bind(&ConfigHandler::process_socket, this, std::placeholders::_1);
         eventHandler.register_socket(config_socket, handler);
@@ -56,31 +59,74 @@ void ConfigHandler::process_socket(uint32_t /*events*/) {
     if (bufsize > 0) {
         std::string buffer;
         buffer.resize(bufsize);
-        int config_size = read(config_socket, buffer.data(), bufsize);
+        sockaddr_un sender = {};
+        socklen_t sender_len = sizeof(sender);
+        int config_size = recvfrom(config_socket, buffer.data(), bufsize, 0, (sockaddr*)&sender, &sender_len);
         if (config_size == -1) {
             std::cout << "warning: config recv failed: " << strerror(errno) << std::endl;
             return;
         }
+        buffer.resize(config_size);
+        std::string line = buffer.substr(0, buffer.find_last_not_of("\r\n") + 1);
+        std::string command = line.substr(0, line.find(' '));
+        auto commandIt = commands.find(command);
+        if (commandIt != commands.end()) {
+            std::stringstream args(line.substr(command.size()));
+            std::string reply = commandIt->second(args);
+            // unbound senders have no address to reply to
+            if (sender_len > sizeof(sa_family_t) &&
+                sendto(config_socket, reply.data(), reply.size(), 0, (sockaddr*)&sender, sender_len) == -1) {
+                std::cout << "warning: failed to reply to command " << command << ": " << strerror(errno) << std::endl;
+            }
+            return;
+        }
         std::stringstream stream(buffer);
         process_config(stream);
     }
 }
 
+void ConfigHandler::register_command(std::string const& name, std::function<std::string()> f) {
+    commands[name] = [f](std::istream& /*args*/) { return f(); };
+}
+
+void ConfigHandler::register_command(std::string const& name, std::function<std::string(std::istream& args)> f) { commands[name] = f; }
+
 void ConfigHandler::process_config(std::istream& config, bool publish) {
-    MAC mac;
+    MAC first;
+    MAC last;
+    uint16_t vlan;
     std::string entry;
     entry.reserve(MAX_ENTRY_LENGTH);
+    // every line is parsed on its own, so an invalid line cannot consume the next one
+    std::string text;
+    std::istringstream line_stream;
     size_t line = 0;
-    while (!config.eof()) {
-        if (parse_mac(config, mac)) {
-            std::getline(config, entry);
-            if (config.fail()) {
-                std::cout << "warning: configuration failure on line: " << line << std::endl;
-            } else {
-                defaultEntries[mac] = entry;
-                if (mqttHandler && publish) mqttHandler->publish_state(mac, entry);
-            }
-        }
+    while (std::getline(config, text)) {
         ++line;
+        if (!text.empty() && text.back() == '\r') {
+            text.pop_back();
+        }
+        if (text.find_first_not_of(" \t") == std::string::npos) {
+            continue;
+        }
+        line_stream.clear();
+        line_stream.str(text);
+        if (!parse_mac_key(line_stream, first, last, vlan)) {
+            std::cout << "warning: invalid mac address on line: " << line << std::endl;
+            continue;
+        }
+        std::getline(line_stream, entry);
+        if (line_stream.fail()) {
+            std::cout << "warning: configuration failure on line: " << line << std::endl;
+        } else if (first == last) {
+            (vlan == 0 ? defaultEntries : vlanEntries[vlan].exact)[first] = entry;
+            if (mqttHandler && publish) mqttHandler->publish_state(first, entry, vlan);
+        } else {
+            (vlan == 0 ? prefixEntries : vlanEntries[vlan].prefixes).insert(first, last, entry);
+        }
+    }
+    prefixEntries.build();
+    for (auto& [vid, entries] : vlanEntries) {
+        entries.prefixes.build();
     }
 }
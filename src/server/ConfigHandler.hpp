@@ -1,19 +1,27 @@
 #pragma once
 #include "EventHandler.hpp"
 #include <string>
+#include <unordered_map>
 
 class MQTTHandler;
 
 class ConfigHandler {
   public:
-    ConfigHandler(EventHandler& eventHandler);
+    // existing_socket is used instead of binding a new socket to path when it is not -1
+    ConfigHandler(EventHandler& eventHandler, std::string const& path, int existing_socket = -1);
     ~ConfigHandler();
     void process_socket(uint32_t events);
     void process_config(std::istream& config, bool publish = true);
+    // a datagram containing only the command name is answered with the output of f
+    void register_command(std::string const& name, std::function<std::string()> f);
+    // a datagram starting with the command name is answered with the output of f, which gets the words after the name
+    void register_command(std::string const& name, std::function<std::string(std::istream& args)> f);
     MQTTHandler* mqttHandler = nullptr;
+    int get_socket() const { return config_socket; }
 
   private:
     int config_socket = -1;
     void create_socket(std::string const& path);
     std::function<void(uint32_t)> handler;
+    std::unordered_map<std::string, std::function<std::string(std::istream& args)>> commands;
 };
@@ -4,7 +4,7 @@
 #include <sys/epoll.h>
 #include <unistd.h>
 
-EventHandler::EventHandler() {
+EpollEventHandler::EpollEventHandler() {
     epfd = epoll_create1(0);
     if (epfd == -1) {
         std::cout << "error: epoll_create failed" << strerror(errno) << std::endl;
@@ -12,13 +12,13 @@ EventHandler::EventHandler() {
     }
 }
 
-EventHandler::~EventHandler() {
+EpollEventHandler::~EpollEventHandler() {
     if (epfd != -1) {
         close(epfd);
     }
 }
 
-void EventHandler::register_socket(int socket, std::function<void(uint32_t)>& f, uint32_t events) {
+void EpollEventHandler::register_socket(int socket, std::function<void(uint32_t)>& f, uint32_t events) {
     epoll_event event;
     event.events = events;
     event.data.ptr = &f;
@@ -29,9 +29,79 @@ void EventHandler::register_socket(int socket, std::function<void(uint32_t)>& f,
     }
 }
 
-void EventHandler::handle_events() {
-    epoll_event event;
+void EpollEventHandler::unregister_socket(int socket) {
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, socket, nullptr) == -1) {
+        std::cout << "warning: failed to remove socket from epoll: " << strerror(errno) << std::endl;
+    }
+}
+
+void EpollEventHandler::register_receiver(int socket, std::function<void(ReceivedFrame const&)>& f) {
+    receivers.push_back([this, socket, &f](uint32_t events) {
+        if (events & EPOLLERR) receive_error_queue(socket, f);
+        receive(socket, f);
+    });
+    register_socket(socket, receivers.back());
+}
+
+void EpollEventHandler::receive(int socket, std::function<void(ReceivedFrame const&)>& f) {
+    // a burst of requests costs one epoll_wait, but at most RECEIVE_BUDGET frames are read per call,
+    // so steady traffic cannot starve the other sockets. epoll is level triggered and reports the rest again
+    for (size_t i = 0; i < RECEIVE_BUDGET; ++i) {
+        sockaddr_ll from = {};
+        iovec iov = {receive_buffer.data(), receive_buffer.size()};
+        msghdr msg = {};
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control_buffer.data();
+        msg.msg_controllen = control_buffer.size();
+        ssize_t r = recvmsg(socket, &msg, MSG_DONTWAIT);
+        if (r == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cout << "warning: failed to receive frame: " << strerror(errno) << std::endl;
+            }
+            return;
+        }
+        if (msg.msg_flags & MSG_TRUNC) {
+            std::cout << "warning: truncated frame: " << r << std::endl;
+            continue;
+        }
+        f(ReceivedFrame{receive_buffer.data(), static_cast<size_t>(r), from, msg});
+    }
+}
+
+void EventHandler::receive_error_queue(int socket, std::function<void(ReceivedFrame const&)>& f) {
+    unsigned char data[MAX_FRAME_SIZE];
+    alignas(cmsghdr) unsigned char control[CONTROL_SIZE];
     while (true) {
+        sockaddr_ll from = {};
+        iovec iov = {data, sizeof(data)};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t r = recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (r == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cout << "warning: failed to read error queue: " << strerror(errno) << std::endl;
+            }
+            return;
+        }
+        f(ReceivedFrame{data, static_cast<size_t>(r), from, msg, true});
+    }
+}
+
+void EpollEventHandler::send(int socket, void const* frame, size_t size, sockaddr_ll const& addr) {
+    if (sendto(socket, frame, size, 0, (const sockaddr*)&addr, (socklen_t)sizeof(addr)) == -1) {
+        std::cout << "failed to send packet: " << strerror(errno) << std::endl;
+    }
+}
+
+void EpollEventHandler::handle_events() {
+    epoll_event event;
+    while (running) {
         int event_count = epoll_wait(epfd, &event, 1, -1);
         if (event_count == 1) {
             (*reinterpret_cast<std::function<void(uint32_t)>*>(event.data.ptr))(event.events);
@@ -1,14 +1,67 @@
 #pragma once
+#include <cstdint>
 #include <functional>
+#include <linux/if_packet.h>
+#include <list>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <vector>
 
+// a frame from a receiver, only valid during the callback
+struct ReceivedFrame {
+    unsigned char const* data;
+    size_t size;
+    sockaddr_ll const& from;
+    // msg_control and msg_controllen hold the control messages of the frame
+    msghdr const& msg;
+    // a frame we sent, read back from the error queue of the socket with its TX timestamp
+    bool error_queue = false;
+};
+
+// Event loop backend.
+// register_socket calls f with the ready events (EPOLL* values) and leaves reading to f.
+// register_receiver reads the frames of a packet socket and calls f once per frame,
+// including the frames queued on the error queue of the socket.
 class EventHandler {
   public:
-    EventHandler();
-    ~EventHandler();
-    void register_socket(int socket, std::function<void(uint32_t)>& f, uint32_t events = EPOLLIN);
-    void handle_events();
+    virtual ~EventHandler() = default;
+    virtual void register_socket(int socket, std::function<void(uint32_t)>& f, uint32_t events = EPOLLIN) = 0;
+    // f is not called for socket after this, also when called from f
+    virtual void unregister_socket(int socket) = 0;
+    virtual void register_receiver(int socket, std::function<void(ReceivedFrame const&)>& f) = 0;
+    // sends may be batched until the current events are handled, frame is copied
+    virtual void send(int socket, void const* frame, size_t size, sockaddr_ll const& addr) = 0;
+    virtual void handle_events() = 0;
+    // handle_events returns once the events that are being handled are done
+    virtual void stop() { running = false; }
+
+    // room for control messages of received frames
+    static constexpr size_t CONTROL_SIZE = 256;
+    // large enough for any frame on a non jumbo interface, including an 802.1Q tag
+    static constexpr size_t MAX_FRAME_SIZE = 2048;
+
+  protected:
+    bool running = true;
+    // drains the error queue of socket, which is reported as EPOLLERR
+    void receive_error_queue(int socket, std::function<void(ReceivedFrame const&)>& f);
+};
+
+class EpollEventHandler : public EventHandler {
+  public:
+    EpollEventHandler();
+    ~EpollEventHandler();
+    void register_socket(int socket, std::function<void(uint32_t)>& f, uint32_t events = EPOLLIN) override;
+    void unregister_socket(int socket) override;
+    void register_receiver(int socket, std::function<void(ReceivedFrame const&)>& f) override;
+    void send(int socket, void const* frame, size_t size, sockaddr_ll const& addr) override;
+    void handle_events() override;
 
   private:
     int epfd;
+    // stable storage for the epoll callbacks of receivers
+    std::list<std::function<void(uint32_t)>> receivers;
+    std::vector<unsigned char> receive_buffer = std::vector<unsigned char>(MAX_FRAME_SIZE);
+    std::vector<unsigned char> control_buffer = std::vector<unsigned char>(CONTROL_SIZE);
+    static constexpr size_t RECEIVE_BUDGET = 64;
+    void receive(int socket, std::function<void(ReceivedFrame const&)>& f);
 };
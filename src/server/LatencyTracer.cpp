@@ -0,0 +1,102 @@
+#include "LatencyTracer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <sstream>
+
+static int64_t now_ns() {
+    // software timestamps are CLOCK_REALTIME
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static int64_t software_timestamp(msghdr const& msg) {
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&msg), cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            scm_timestamping timestamps;
+            std::memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+            return timestamps.ts[0].tv_sec * 1000000000ll + timestamps.ts[0].tv_nsec;
+        }
+    }
+    return -1;
+}
+
+LatencyTracer::LatencyTracer(size_t records) : ring(records), pending_tx(records) {}
+
+void LatencyTracer::request(MAC const& client, msghdr const& msg) { current = {client, software_timestamp(msg), now_ns(), -1, -1}; }
+
+void LatencyTracer::reply() {
+    if (current.user_ns == 0) return;
+    Record& record = ring[recorded++ % ring.size()];
+    record = current;
+    current = {};
+    record.send_ns = now_ns();
+    if (record.rx_ns != -1) count(RX_TO_USER, record.user_ns - record.rx_ns);
+    count(USER_TO_SEND, record.send_ns - record.user_ns);
+    if (pending_tail - pending_head == pending_tx.size()) {
+        ++pending_head;
+    }
+    pending_tx[pending_tail++ % pending_tx.size()] = recorded - 1;
+}
+
+void LatencyTracer::transmitted(unsigned char const* frame, size_t size, msghdr const& msg) {
+    // heartbeats go to a multicast group
+    if (size < sizeof(MAC) || (frame[0] & 1)) return;
+    int64_t tx_ns = software_timestamp(msg);
+    if (tx_ns == -1) return;
+    for (uint64_t i = pending_head; i < pending_tail && i - pending_head < MATCH_WINDOW; ++i) {
+        uint64_t position = pending_tx[i % pending_tx.size()];
+        Record& record = ring[position % ring.size()];
+        // the record was overwritten by newer requests
+        if (recorded - position > ring.size()) continue;
+        if (std::memcmp(record.client.data(), frame, sizeof(MAC)) == 0) {
+            record.tx_ns = tx_ns;
+            count(SEND_TO_TX, tx_ns - record.send_ns);
+            pending_head = i + 1;
+            return;
+        }
+    }
+}
+
+void LatencyTracer::count(Stage stage, int64_t ns) {
+    size_t bucket = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+    ++histograms[stage][bucket];
+}
+
+std::string LatencyTracer::trace(size_t offset, size_t count) const {
+    std::stringstream out;
+    uint64_t first = (recorded > ring.size() ? recorded - ring.size() : 0) + offset;
+    uint64_t last = std::min<uint64_t>(recorded, first + std::min(count, MAX_TRACE_LINES));
+    for (uint64_t i = first; i < last; ++i) {
+        Record const& record = ring[i % ring.size()];
+        char mac_str[MAC_STR_SIZE];
+        format_mac(record.client, mac_str);
+        out << mac_str << " " << record.rx_ns;
+        out << " " << (record.rx_ns != -1 ? record.user_ns - record.rx_ns : -1);
+        out << " " << (record.send_ns != -1 ? record.send_ns - record.user_ns : -1);
+        out << " " << (record.tx_ns != -1 ? record.tx_ns - record.send_ns : -1) << "\n";
+    }
+    return out.str();
+}
+
+std::string LatencyTracer::trace_command(std::istream& args) const {
+    size_t offset;
+    size_t count;
+    if (args >> offset >> count) {
+        return trace(offset, count);
+    }
+    size_t stored = std::min<uint64_t>(recorded, ring.size());
+    return trace(stored > MAX_TRACE_LINES ? stored - MAX_TRACE_LINES : 0, MAX_TRACE_LINES);
+}
+
+std::string LatencyTracer::latency() const {
+    std::stringstream out;
+    for (size_t stage = 0; stage < STAGES; ++stage) {
+        for (size_t bucket = 0; bucket < histograms[stage].size(); ++bucket) {
+            if (histograms[stage][bucket] > 0) {
+                out << stage_names[stage] << " " << (bucket > 0 ? 1ull << (bucket - 1) : 0) << " " << histograms[stage][bucket] << "\n";
+            }
+        }
+    }
+    return out.str();
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "common.hpp"
+#include <array>
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+// Per request latency trace from the kernel software timestamps of the data socket.
+// Each answered request is recorded with its kernel RX, userspace, send and kernel TX time in a fixed-size ring,
+// requests that are not answered (misses, suppressed, other shards) are not recorded,
+// and every interval between them is counted in a log2 histogram per stage.
+// TX timestamps come back on the error queue with a copy of the reply,
+// they are matched to the oldest reply to the same client that is still waiting for one.
+class LatencyTracer {
+  public:
+    // keeps the last records answered requests
+    explicit LatencyTracer(size_t records);
+    // a request from client arrived, msg holds its RX timestamp
+    void request(MAC const& client, msghdr const& msg);
+    // the reply to the last request is about to be sent, which records it
+    void reply();
+    // a sent frame from the error queue, msg holds its TX timestamp
+    void transmitted(unsigned char const* frame, size_t size, msghdr const& msg);
+    // one line per record: client rx_ns rx_to_user_ns user_to_send_ns send_to_tx_ns, -1 for what did not happen.
+    // returns up to count records starting at offset from the oldest one, at most MAX_TRACE_LINES so the reply fits in a datagram
+    std::string trace(size_t offset, size_t count) const;
+    // the trace command: no arguments for the newest MAX_TRACE_LINES records, or offset and count
+    std::string trace_command(std::istream& args) const;
+    static constexpr size_t MAX_TRACE_LINES = 512;
+    // one line per non empty histogram bucket: stage bucket_start_ns count
+    std::string latency() const;
+
+  private:
+    struct Record {
+        MAC client;
+        int64_t rx_ns;
+        int64_t user_ns;
+        int64_t send_ns;
+        int64_t tx_ns;
+    };
+    // the request that is being handled, recorded once it is answered
+    Record current = {};
+    std::vector<Record> ring;
+    // number of answered requests recorded so far, the ring holds the last ring.size() of them
+    uint64_t recorded = 0;
+    // replied requests waiting for their TX timestamp, oldest first
+    std::vector<uint64_t> pending_tx;
+    uint64_t pending_head = 0;
+    uint64_t pending_tail = 0;
+    // how many pending replies are searched for the client of a TX timestamp,
+    // the replies before the match lost their timestamp
+    static constexpr uint64_t MATCH_WINDOW = 16;
+
+    enum Stage { RX_TO_USER, USER_TO_SEND, SEND_TO_TX, STAGES };
+    static constexpr std::array<char const*, STAGES> stage_names = {"rx_to_user", "user_to_send", "send_to_tx"};
+    // bucket b counts intervals in [2^(b-1), 2^b) ns, bucket 0 counts intervals <= 0
+    std::array<std::array<uint64_t, 64>, STAGES> histograms = {};
+    void count(Stage stage, int64_t ns);
+};
@@ -3,11 +3,13 @@
 #include "src/server/ConfigHandler.hpp"
 #include <chrono>
 #include <climits>
+#include <cstring>
 #include <iostream>
 #include <json.hpp>
+#include <poll.h>
 #include <stdio.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
-#include <sys/timerfd.h>
 #include <thread>
 #include <unistd.h>
 
@@ -15,88 +17,76 @@ using json = nlohmann::json;
 
 void message_callback(mosquitto* /*mqtt*/, void* obj, const mosquitto_message* msg) {
     if (msg->payloadlen > 0) {
-        std::string tmp((char*)msg->payload, msg->payloadlen);
-        std::stringstream config_message(tmp);
-        reinterpret_cast<MQTTHandler*>(obj)->configHandler.process_config(config_message);
+        reinterpret_cast<MQTTHandler*>(obj)->receive_message(msg->topic, std::string((char*)msg->payload, msg->payloadlen));
     }
 }
 
-void state_callback(mosquitto* /*mqtt*/, void* obj, const mosquitto_message* msg) {
-    if (msg->payloadlen > 0) {
-        std::string topic(msg->topic);
-        std::string entry((char*)msg->payload, msg->payloadlen);
-        std::stringstream config(topic + " " + entry);
-        reinterpret_cast<MQTTHandler*>(obj)->configHandler.process_config(config, false);
-    }
+void connect_callback(mosquitto* /*mqtt*/, void* obj, int rc) { reinterpret_cast<MQTTHandler*>(obj)->on_connect(rc); }
+
+void disconnect_callback(mosquitto* /*mqtt*/, void* obj, int rc) { reinterpret_cast<MQTTHandler*>(obj)->on_disconnect(rc); }
+
+static std::string format_source(MAC const& mac) {
+    char source_tmp[18];
+    snprintf(source_tmp, sizeof(source_tmp), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return source_tmp;
 }
 
 MQTTHandler::MQTTHandler(EventHandler& eventHandler, ConfigHandler& configHandler, std::string const& host, uint16_t const& port,
                          std::string const& username, std::string const& password)
-    : configHandler(configHandler) {
+    : configHandler(configHandler), host(host), port(port) {
     mosquitto_lib_init();
     mqtt = mosquitto_new(NULL, true, this);
     mosquitto_username_pw_set(mqtt, username.c_str(), password.c_str());
-    int r = mosquitto_connect(mqtt, host.c_str(), port, 60);
-    if (r != MOSQ_ERR_SUCCESS) {
-        std::cout << "warning: could not connect to mqtt broker: " << r << std::endl;
-    } else {
-        mqtt_socket = mosquitto_socket(mqtt);
-        if (mqtt_socket != -1) {
-            mosquitto_subscribe(mqtt, nullptr, mqtt_topic.c_str(), 0);
-            timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-            if (timer_fd == -1) {
-                std::cout << "warning: could not create mqtt timer" << std::endl;
-            } else {
-                itimerspec ts = {};
-                ts.it_interval.tv_sec = 0;
-                ts.it_interval.tv_nsec = 100 * 1000 * 1000; // 100ms
-                ts.it_value = ts.it_interval;
-                timerfd_settime(timer_fd, 0, &ts, nullptr);
-
-                handler = std::bind(&MQTTHandler::process_socket, this, std::placeholders::_1);
-                eventHandler.register_socket(timer_fd, timerHandler);
-                timerHandler = std::bind(&MQTTHandler::process_timer, this, std::placeholders::_1);
-                eventHandler.register_socket(mqtt_socket, handler, EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP);
-
-                mosquitto_message_callback_set(mqtt, message_callback);
-            }
+    mosquitto_message_callback_set(mqtt, message_callback);
+    mosquitto_connect_callback_set(mqtt, connect_callback);
+    mosquitto_disconnect_callback_set(mqtt, disconnect_callback);
 
-        } else {
-            std::cout << "warning: failed to get mqtt_socket" << std::endl;
-        }
+    worker_wake_fd = eventfd(0, EFD_NONBLOCK);
+    config_wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (worker_wake_fd == -1 || config_wake_fd == -1) {
+        std::cout << "error: could not create mqtt eventfd: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+    incomingHandler = std::bind(&MQTTHandler::process_incoming, this, std::placeholders::_1);
+    eventHandler.register_socket(config_wake_fd, incomingHandler);
+
+    if (host.size() == 0) {
+        std::cout << "warning: no mqtt host, mqtt is disabled" << std::endl;
+    } else {
+        running = true;
+        worker = std::thread(&MQTTHandler::run, this);
     }
 }
 
+void MQTTHandler::start() {
+    started = true;
+    uint64_t wake = 1;
+    write(worker_wake_fd, &wake, sizeof(wake));
+}
+
 MQTTHandler::~MQTTHandler() {
+    if (running) {
+        running = false;
+        uint64_t wake = 1;
+        write(worker_wake_fd, &wake, sizeof(wake));
+        worker.join();
+    }
     mosquitto_disconnect(mqtt);
     mosquitto_destroy(mqtt);
     mosquitto_lib_cleanup();
-    if (timer_fd != -1) {
-        close(timer_fd);
-    }
+    close(worker_wake_fd);
+    close(config_wake_fd);
 }
 
-void MQTTHandler::get_state(std::string const& host, int const& port, std::string const& username, std::string const& password) {
-
-    mosquitto* mqtt_state = mosquitto_new(NULL, true, this);
-    mosquitto_username_pw_set(mqtt_state, username.c_str(), password.c_str());
-    int r = mosquitto_connect(mqtt_state, host.c_str(), port, 60);
-    if (r == MOSQ_ERR_SUCCESS) {
-        mosquitto_message_callback_set(mqtt_state, state_callback);
-        std::string topic(mqtt_topic + "/state/+");
-        r = mosquitto_subscribe(mqtt_state, NULL, topic.c_str(), 0);
-        if (r == MOSQ_ERR_SUCCESS) {
-            r = mosquitto_loop_start(mqtt_state);
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            r = mosquitto_disconnect(mqtt_state);
-            r = mosquitto_loop_stop(mqtt_state, false);
-            if (r == MOSQ_ERR_SUCCESS) return;
-        }
-    }
-    std::cout << "warning: failed to get inital state" << std::endl;
+void MQTTHandler::upload_menuentries(MAC const& mac, std::unordered_map<std::string, std::string> menuentries) {
+    MQTTMessage message;
+    message.type = MQTTMessage::Type::Menu;
+    message.mac = mac;
+    message.menuentries = std::move(menuentries);
+    publish(std::move(message));
 }
 
-void MQTTHandler::upload_menuentries(MAC const& mac, std::unordered_map<std::string, std::string> const& menuentries) {
+std::string MQTTHandler::discovery_payload(MAC const& mac, std::unordered_map<std::string, std::string> const& menuentries) {
 
     json options = {};
     json id_to_title = {};
@@ -119,9 +109,7 @@ void MQTTHandler::upload_menuentries(MAC const& mac, std::unordered_map<std::str
         },
         {"cmps", {}}
     };
-    char source_tmp[18];
-    snprintf(source_tmp, sizeof(source_tmp), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-    std::string source(source_tmp);
+    std::string source = format_source(mac);
 
     std::string command_template = "{% set map = " + title_to_id.dump(0) + " %}" + source + " {{ map[value] }}";
     std::string value_template = "{% set map = " + id_to_title.dump(0) + " %}{{ map[value] }}";
@@ -137,35 +125,214 @@ void MQTTHandler::upload_menuentries(MAC const& mac, std::unordered_map<std::str
     {"value_template", value_template}
     };
 
-    std::string payload_str = payload.dump();
-    mosquitto_publish(mqtt, NULL, discovery_topic.c_str(), payload_str.size(), payload_str.c_str(), 0, true);
+    return payload.dump();
+}
+
+void MQTTHandler::publish_state(MAC const& mac, std::string const& entry, uint16_t vlan) {
+    MQTTMessage message;
+    message.type = MQTTMessage::Type::State;
+    message.mac = mac;
+    message.vlan = vlan;
+    message.entry = entry;
+    publish(std::move(message));
 }
 
-void MQTTHandler::process_socket(uint32_t events) {
-    if (events & EPOLLIN) {
-        mosquitto_loop_read(mqtt, 1);
+void MQTTHandler::publish(MQTTMessage&& message) {
+    if (!running) return;
+    if (!outgoing.push(std::move(message))) {
+        ++outgoing_drops;
+        return;
     }
-    if (events & EPOLLOUT) {
-        mosquitto_loop_write(mqtt, 1);
+    uint64_t wake = 1;
+    write(worker_wake_fd, &wake, sizeof(wake));
+}
+
+void MQTTHandler::receive_message(std::string const& topic, std::string payload) {
+    std::string state_prefix = mqtt_topic + "/state/";
+    if (topic == mqtt_topic) {
+        if (!receive_config(std::move(payload), true)) ++incoming_drops;
+    } else if (topic.starts_with(state_prefix)) {
+        // states we published ourselves or already applied come back on every (re)subscribe
+        auto [it, inserted] = known_states.try_emplace(topic, payload);
+        if (!inserted) {
+            if (it->second == payload) return;
+            it->second = payload;
+        }
+        // the topic ends with the MAC of the state, followed by @vid for the entries of a VLAN.
+        // a dropped state is kept and pushed again by the mqtt thread once the event loop drained the queue
+        dropped_states.erase(topic);
+        std::string config = topic.substr(state_prefix.size()) + " " + payload;
+        if (!receive_config(config, false)) {
+            ++incoming_drops;
+            dropped_states[topic] = std::move(config);
+        }
     }
 }
 
-void MQTTHandler::process_timer(uint32_t /*events*/) {
-    uint64_t exp;
-    read(timer_fd, &exp, sizeof(exp));
-    mosquitto_loop_misc(mqtt);
+void MQTTHandler::retry_dropped_states() {
+    while (!dropped_states.empty()) {
+        auto it = dropped_states.begin();
+        if (!receive_config(it->second, false)) return;
+        dropped_states.erase(it);
+    }
 }
 
-void MQTTHandler::publish_state(MAC const& mac, std::string const& entry){
+bool MQTTHandler::receive_config(std::string config, bool publish) {
+    // the mqtt thread never waits for the event loop, like the outgoing queue this drops
+    if (!incoming.push(ConfigMessage{std::move(config), publish})) {
+        return false;
+    }
+    uint64_t wake = 1;
+    write(config_wake_fd, &wake, sizeof(wake));
+    return true;
+}
 
-    char source_tmp[18];
-    snprintf(source_tmp, sizeof(source_tmp), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-    std::string source(source_tmp);
+void MQTTHandler::process_incoming(uint32_t /*events*/) {
+    uint64_t count;
+    read(config_wake_fd, &count, sizeof(count));
+    ConfigMessage message;
+    while (incoming.pop(message)) {
+        std::stringstream config(message.config);
+        configHandler.process_config(config, message.publish);
+    }
+}
 
-    std::string topic = mqtt_topic + "/state/" + source;
+void MQTTHandler::connect() {
+    // mosquitto resolves the host here, which only blocks the mqtt thread
+    int r = attempted ? mosquitto_reconnect_async(mqtt) : mosquitto_connect_async(mqtt, host.c_str(), port, 60);
+    attempted = true;
+    if (r != MOSQ_ERR_SUCCESS) {
+        std::cout << "warning: could not connect to mqtt broker: " << mosquitto_strerror(r) << std::endl;
+        schedule_reconnect();
+        return;
+    }
+    mqtt_socket = mosquitto_socket(mqtt);
+    state = State::Connecting;
+}
+
+void MQTTHandler::schedule_reconnect() {
+    state = State::Disconnected;
+    connected = false;
+    mqtt_socket = -1;
+    next_attempt = std::chrono::steady_clock::now() + backoff;
+    backoff = std::min(backoff * 2, MAX_BACKOFF);
+}
+
+void MQTTHandler::on_connect(int rc) {
+    if (rc != 0) {
+        std::cout << "warning: mqtt broker refused connection: " << rc << std::endl;
+        schedule_reconnect();
+        return;
+    }
+    if (was_connected) ++reconnects;
+    was_connected = true;
+    state = State::Connected;
+    connected = true;
+    backoff = MIN_BACKOFF;
+
+    // publish what changed while disconnected before subscribing,
+    // so the retained states we get back already include our changes
+    for (auto const& [topic, entry] : pending_states) {
+        publish_state_topic(topic, entry);
+    }
+    pending_states.clear();
+    for (auto const& [mac, payload] : pending_discoveries) {
+        mosquitto_publish(mqtt, NULL, discovery_topic.c_str(), payload.size(), payload.c_str(), 0, true);
+    }
+    pending_discoveries.clear();
+    // the session is clean, so subscriptions have to be made again on every connect
+    mosquitto_subscribe(mqtt, nullptr, mqtt_topic.c_str(), 0);
+    mosquitto_subscribe(mqtt, nullptr, (mqtt_topic + "/state/+").c_str(), 0);
+}
+
+void MQTTHandler::on_disconnect(int rc) {
+    if (state == State::Disconnected) return;
+    std::cout << "warning: disconnected from mqtt broker: " << rc << std::endl;
+    schedule_reconnect();
+}
+
+void MQTTHandler::run() {
+    pollfd fds[2] = {
+        {worker_wake_fd, POLLIN, 0},
+        {-1,             POLLIN, 0},
+    };
+    while (running) {
+        if (started && state == State::Disconnected && std::chrono::steady_clock::now() >= next_attempt) {
+            connect();
+        }
+        fds[1].fd = mqtt_socket;
+        fds[1].events = POLLIN | (mosquitto_want_write(mqtt) ? POLLOUT : 0);
+        fds[1].revents = 0;
+        // the timeout keeps mosquitto_loop_misc running for keepalives and retries the connection
+        if (poll(fds, 2, 100) == -1 && errno != EINTR) {
+            std::cout << "warning: mqtt poll failed: " << strerror(errno) << std::endl;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            read(worker_wake_fd, &count, sizeof(count));
+        }
+        process_outgoing();
+        // the poll timeout retries the dropped states while nothing else happens
+        retry_dropped_states();
+        if (state == State::Disconnected) continue;
+
+        int r = MOSQ_ERR_SUCCESS;
+        if (fds[1].revents & (POLLIN | POLLERR | POLLHUP)) {
+            r = mosquitto_loop_read(mqtt, 1);
+        }
+        if (r == MOSQ_ERR_SUCCESS && (fds[1].revents & POLLOUT)) {
+            r = mosquitto_loop_write(mqtt, 1);
+        }
+        if (r == MOSQ_ERR_SUCCESS) {
+            r = mosquitto_loop_misc(mqtt);
+        }
+        if (r != MOSQ_ERR_SUCCESS) {
+            on_disconnect(r);
+        }
+    }
+}
 
-    // TODO:
-    // subscribe to this once on startup
-    mosquitto_publish(mqtt, NULL, topic.c_str(), entry.size(), entry.c_str(), 0, true);
+void MQTTHandler::publish_state_topic(std::string const& topic, std::string const& entry) {
+    auto known = known_states.find(topic);
+    if (known != known_states.end() && known->second == entry) return;
+    if (mosquitto_publish(mqtt, NULL, topic.c_str(), entry.size(), entry.c_str(), 0, true) == MOSQ_ERR_SUCCESS) {
+        known_states[topic] = entry;
+    } else {
+        pending_states[topic] = entry;
+    }
 }
 
+void MQTTHandler::process_outgoing() {
+    MQTTMessage message;
+    while (outgoing.pop(message)) {
+        if (message.type == MQTTMessage::Type::Menu) {
+            std::string payload = discovery_payload(message.mac, message.menuentries);
+            if (state == State::Connected) {
+                mosquitto_publish(mqtt, NULL, discovery_topic.c_str(), payload.size(), payload.c_str(), 0, true);
+            } else {
+                pending_discoveries[message.mac] = std::move(payload);
+            }
+        } else {
+            std::string topic = mqtt_topic + "/state/" + format_source(message.mac);
+            if (message.vlan != 0) topic.append("@").append(std::to_string(message.vlan));
+            // a local change is newer than a state from the broker that still waits for the queue
+            dropped_states.erase(topic);
+            if (state == State::Connected) {
+                publish_state_topic(topic, message.entry);
+            } else {
+                pending_states[topic] = std::move(message.entry);
+            }
+        }
+    }
+}
+
+std::string MQTTHandler::stats() const {
+    std::stringstream out;
+    out << "connected " << connected << "\n";
+    out << "reconnects " << reconnects << "\n";
+    out << "outgoing_depth " << outgoing.size() << "\n";
+    out << "outgoing_drops " << outgoing_drops << "\n";
+    out << "incoming_depth " << incoming.size() << "\n";
+    out << "incoming_drops " << incoming_drops << "\n";
+    return out.str();
+}
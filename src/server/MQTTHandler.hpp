@@ -1,30 +1,110 @@
 #pragma once
 #include "ConfigHandler.hpp"
 #include "EventHandler.hpp"
+#include "SPSCQueue.hpp"
 #include "common.hpp"
+#include <atomic>
+#include <chrono>
 #include <mosquitto.h>
 #include <string>
+#include <thread>
 
 void message_callback(mosquitto* mqtt, void* obj, const mosquitto_message* msg);
+void connect_callback(mosquitto* mqtt, void* obj, int rc);
+void disconnect_callback(mosquitto* mqtt, void* obj, int rc);
 
+// work for the mqtt thread
+struct MQTTMessage {
+    enum class Type { State, Menu } type = Type::State;
+    MAC mac = {};
+    // 0 for the shared entries
+    uint16_t vlan = 0;
+    std::string entry;
+    std::unordered_map<std::string, std::string> menuentries;
+};
+
+// config received from mqtt, applied on the event loop thread
+struct ConfigMessage {
+    std::string config;
+    bool publish = true;
+};
+
+// All mosquitto I/O and serialization runs on a dedicated thread,
+// so a slow or unreachable broker never delays replies on the event loop thread.
+// Publishes are handed to that thread and received configs are handed back through bounded SPSC queues,
+// messages that do not fit are dropped and counted.
+// The mqtt thread connects without blocking and reconnects with exponential backoff.
+// Changes made while disconnected are published once the connection is back,
+// and retained states from the broker are only applied when they differ from the last known state.
 class MQTTHandler {
   public:
     MQTTHandler(EventHandler& eventHandler, ConfigHandler& configHandler, std::string const& host, uint16_t const& port,
                 std::string const& username, std::string const& password);
     ~MQTTHandler();
-    void upload_menuentries(MAC const& source, std::unordered_map<std::string, std::string> const& menuentries);
+    // starts connecting to the broker in the background,
+    // publishes made before this are sent right after connecting
+    void start();
+    void upload_menuentries(MAC const& source, std::unordered_map<std::string, std::string> menuentries);
     ConfigHandler& configHandler;
-    void publish_state(MAC const& mac, std::string const& entry);
-    void get_state(std::string const& host, int const& port, std::string const& username, std::string const& password);
+    // entries of a VLAN are published as remote_bootselect/state/mac@vid
+    void publish_state(MAC const& mac, std::string const& entry, uint16_t vlan = 0);
+    std::string stats() const;
+    static std::string discovery_payload(MAC const& mac, std::unordered_map<std::string, std::string> const& menuentries);
+
+    // called on the mqtt thread from the mosquitto callbacks
+    void receive_message(std::string const& topic, std::string payload);
+    void on_connect(int rc);
+    void on_disconnect(int rc);
 
   private:
-    const std::string mqtt_topic = "remote_bootselect";
-    const std::string discovery_topic = "homeassistant/device/remote_bootselect/config";
+    inline static const std::string mqtt_topic = "remote_bootselect";
+    inline static const std::string discovery_topic = "homeassistant/device/remote_bootselect/config";
     mosquitto* mqtt;
+    std::string host;
+    uint16_t port;
+    void publish(MQTTMessage&& message);
+    // false if the queue to the event loop is full and the config was dropped
+    bool receive_config(std::string config, bool publish);
+    // state topic -> config line of a retained state that did not fit in the incoming queue, only touched by the mqtt thread
+    std::unordered_map<std::string, std::string> dropped_states;
+    void retry_dropped_states();
+
+    // event loop thread -> mqtt thread
+    SPSCQueue<MQTTMessage, 4096> outgoing;
+    std::atomic<uint64_t> outgoing_drops = 0;
+    int worker_wake_fd = -1;
+    // mqtt thread -> event loop thread
+    SPSCQueue<ConfigMessage, 4096> incoming;
+    std::atomic<uint64_t> incoming_drops = 0;
+    int config_wake_fd = -1;
+    void process_incoming(uint32_t events);
+    std::function<void(uint32_t events)> incomingHandler;
+
+    std::thread worker;
+    std::atomic<bool> running = false;
+    std::atomic<bool> started = false;
+    void run();
+    void process_outgoing();
+
+    // connection state, only touched by the mqtt thread
+    enum class State { Disconnected, Connecting, Connected };
+    State state = State::Disconnected;
+    std::atomic<bool> connected = false;
+    std::atomic<uint64_t> reconnects = 0;
+    bool attempted = false;
+    bool was_connected = false;
     int mqtt_socket = -1;
-    int timer_fd = -1;
-    void process_socket(uint32_t events);
-    std::function<void(uint32_t events)> handler;
-    void process_timer(uint32_t events);
-    std::function<void(uint32_t events)> timerHandler;
+    std::chrono::seconds backoff = MIN_BACKOFF;
+    std::chrono::steady_clock::time_point next_attempt;
+    static constexpr std::chrono::seconds MIN_BACKOFF = std::chrono::seconds(1);
+    static constexpr std::chrono::seconds MAX_BACKOFF = std::chrono::seconds(60);
+    void connect();
+    void schedule_reconnect();
+    // state topic -> entry as last seen on the broker
+    std::unordered_map<std::string, std::string> known_states;
+    // state topic -> entry changed locally while disconnected
+    std::unordered_map<std::string, std::string> pending_states;
+    // client -> discovery payload of its last menu, built while disconnected
+    std::unordered_map<MAC, std::string> pending_discoveries;
+    void publish_state_topic(std::string const& topic, std::string const& entry);
 };
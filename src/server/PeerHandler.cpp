@@ -0,0 +1,126 @@
+#include "PeerHandler.hpp"
+#include "RequestHandler.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t expiry_ns(uint32_t interval_ms) { return interval_ms * 1000ull * 1000; }
+
+// splitmix64 finalizer
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t score(uint64_t client, MAC const& instance) { return mix(client ^ mix(mac_to_u64(instance))); }
+
+PeerHandler::PeerHandler(EventHandler& eventHandler, RequestHandler& requestHandler, uint32_t interval_ms)
+    : requestHandler(requestHandler), interval_ms(interval_ms) {
+    requestHandler.join_group(peer_group_addr);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer_fd == -1) {
+        std::cout << "error: could not create heartbeat timer: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+    // heartbeats go out twice per interval, so one late or lost heartbeat does not expire a live peer
+    uint32_t period_ms = std::max(interval_ms / 2, 1u);
+    itimerspec ts = {};
+    ts.it_interval.tv_sec = period_ms / 1000;
+    ts.it_interval.tv_nsec = (period_ms % 1000) * 1000 * 1000;
+    // announce ourselves right away so peers stop answering our share of clients
+    ts.it_value.tv_nsec = 1;
+    timerfd_settime(timer_fd, 0, &ts, nullptr);
+    timerHandler = std::bind(&PeerHandler::process_timer, this, std::placeholders::_1);
+    eventHandler.register_socket(timer_fd, timerHandler);
+}
+
+PeerHandler::~PeerHandler() {
+    if (timer_fd != -1) {
+        close(timer_fd);
+    }
+}
+
+void PeerHandler::process_timer(uint32_t /*events*/) {
+    uint64_t exp;
+    read(timer_fd, &exp, sizeof(exp));
+    send_heartbeat();
+
+    uint64_t now = now_ns();
+    for (auto it = expiry.begin(); it != expiry.end();) {
+        if (it->second < now) {
+            std::cout << "peer left: ";
+            print_mac(it->first);
+            std::cout << std::endl;
+            it = expiry.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void PeerHandler::send_heartbeat() {
+    HeartbeatFrame heartbeat = {};
+    std::memcpy(heartbeat.hdr.h_dest, peer_group_addr.data(), sizeof(MAC));
+    std::memcpy(heartbeat.hdr.h_source, requestHandler.get_hwaddr().data(), sizeof(MAC));
+    heartbeat.hdr.h_proto = htons(ETHERTYPE);
+    heartbeat.interval_ms = htonl(interval_ms);
+    requestHandler.send_frame(&heartbeat, sizeof(heartbeat));
+}
+
+void PeerHandler::process_heartbeat(unsigned char const* frame, size_t size) {
+    if (size < sizeof(HeartbeatFrame)) {
+        std::cout << "warning: short heartbeat frame: " << size << std::endl;
+        return;
+    }
+    HeartbeatFrame heartbeat;
+    std::memcpy(&heartbeat, frame, sizeof(heartbeat));
+    MAC peer;
+    std::memcpy(peer.data(), heartbeat.hdr.h_source, peer.size());
+    if (peer == requestHandler.get_hwaddr()) {
+        return;
+    }
+    auto [it, inserted] = expiry.try_emplace(peer);
+    it->second = now_ns() + expiry_ns(ntohl(heartbeat.interval_ms));
+    if (inserted) {
+        std::cout << "peer joined: ";
+        print_mac(peer);
+        std::cout << std::endl;
+    }
+}
+
+bool PeerHandler::is_responder(MAC const& client) {
+    uint64_t key = mac_to_u64(client);
+    uint64_t own = score(key, requestHandler.get_hwaddr());
+    // expiry is checked here instead of relying on the timer, so failover does not wait for the next tick
+    uint64_t now = now_ns();
+    for (auto const& [peer, expires] : expiry) {
+        if (expires >= now && score(key, peer) > own) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string PeerHandler::peers() {
+    std::stringstream out;
+    uint64_t now = now_ns();
+    for (auto const& [peer, expires] : expiry) {
+        char mac[18];
+        snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x", peer[0], peer[1], peer[2], peer[3], peer[4], peer[5]);
+        out << mac << (expires >= now ? " live" : " expired") << "\n";
+    }
+    return out.str();
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "EventHandler.hpp"
+#include "common.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+class RequestHandler;
+
+// locally administered multicast group that instances send heartbeats to
+const MAC peer_group_addr = {0x03, 0x00, 0x00, 0x00, 0x71, 0x84};
+
+struct __attribute__((packed)) HeartbeatFrame {
+    ethhdr hdr;
+    // network byte order, lets peers with different intervals expire each other correctly
+    uint32_t interval_ms;
+};
+
+// Tracks the other instances on the segment through heartbeats
+// and shards broadcast requests between all live instances with rendezvous hashing on the client MAC,
+// so exactly one instance answers each client.
+// Heartbeats are sent twice per interval, and a peer is dropped one interval after its last heartbeat.
+class PeerHandler {
+  public:
+    PeerHandler(EventHandler& eventHandler, RequestHandler& requestHandler, uint32_t interval_ms);
+    ~PeerHandler();
+    void process_heartbeat(unsigned char const* frame, size_t size);
+    bool is_responder(MAC const& client);
+    std::string peers();
+
+  private:
+    RequestHandler& requestHandler;
+    uint32_t interval_ms;
+    int timer_fd = -1;
+    // peer MAC -> time after which the peer is considered dead
+    std::unordered_map<MAC, uint64_t> expiry;
+    void process_timer(uint32_t events);
+    std::function<void(uint32_t events)> timerHandler;
+    void send_heartbeat();
+};
@@ -0,0 +1,90 @@
+#include "PrefixTable.hpp"
+#include <algorithm>
+#include <numeric>
+
+PrefixTable prefixEntries;
+std::unordered_map<uint16_t, VlanEntries> vlanEntries;
+
+static constexpr uint64_t MAC_BITS = 48;
+
+void PrefixTable::insert(MAC const& first, MAC const& last, std::string const& entry) {
+    uint64_t begin = mac_to_u64(first);
+    uint64_t end = mac_to_u64(last) + 1;
+    while (begin < end) {
+        // largest aligned block starting at begin that fits in the range
+        uint64_t block_bits = begin == 0 ? MAC_BITS : std::min<uint64_t>(__builtin_ctzll(begin), MAC_BITS);
+        while ((1ull << block_bits) > end - begin) {
+            --block_bits;
+        }
+        uint8_t length = MAC_BITS - block_bits;
+        auto [it, inserted] = rule_index.try_emplace(begin << 8 | length, rules.size());
+        if (inserted) {
+            rules.push_back({begin, length, entry});
+        } else {
+            rules[it->second].entry = entry;
+        }
+        begin += 1ull << block_bits;
+    }
+    dirty = true;
+}
+
+void PrefixTable::write(std::ostream& out, uint16_t vlan) const {
+    for (Rule const& rule : rules) {
+        MAC prefix;
+        for (size_t i = 0; i < prefix.size(); ++i) {
+            prefix[i] = (rule.prefix >> (40 - 8 * i)) & 0xff;
+        }
+        char mac_str[MAC_STR_SIZE];
+        format_mac(prefix, mac_str);
+        out << mac_str << "/" << static_cast<unsigned>(rule.length);
+        if (vlan != 0) out << "@" << vlan;
+        out << " " << rule.entry << "\n";
+    }
+}
+
+void PrefixTable::build() {
+    if (!dirty) return;
+    dirty = false;
+    nodes.assign(1, {});
+    // compiling shorter prefixes first lets longer ones simply overwrite them
+    std::vector<uint32_t> order(rules.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return rules[a].length < rules[b].length; });
+    for (uint32_t idx : order) {
+        compile(rules[idx], idx + 1);
+    }
+}
+
+void PrefixTable::compile(Rule const& rule, uint32_t value) {
+    size_t node = 0;
+    for (uint64_t depth = 0;; ++depth) {
+        uint8_t byte = (rule.prefix >> (40 - 8 * depth)) & 0xff;
+        uint64_t level_bits = 8 * (depth + 1);
+        if (rule.length <= level_bits) {
+            // controlled prefix expansion: a /20 covers 16 slots of its last level
+            uint32_t span = 1u << (level_bits - rule.length);
+            uint32_t base = byte & ~(span - 1);
+            std::fill_n(nodes[node].begin() + base, span, value);
+            return;
+        }
+        uint32_t slot = nodes[node][byte];
+        if (!(slot & CHILD)) {
+            // push the shorter match down so the child answers for the whole subtree
+            nodes.emplace_back();
+            nodes.back().fill(slot);
+            slot = CHILD | (nodes.size() - 1);
+            nodes[node][byte] = slot;
+        }
+        node = slot & ~CHILD;
+    }
+}
+
+std::string const* PrefixTable::find(MAC const& mac) const {
+    if (rules.empty()) return nullptr;
+    size_t depth = 0;
+    uint32_t slot = nodes[0][mac[0]];
+    while (slot & CHILD) {
+        slot = nodes[slot & ~CHILD][mac[++depth]];
+    }
+    return slot ? &rules[slot - 1].entry : nullptr;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "common.hpp"
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Longest prefix match over the 48 bit MAC space.
+// Rules are kept in a list and compiled into a stride 8 trie with leaf pushing,
+// so a lookup reads at most one 1KiB node per MAC byte and usually only the first few.
+class PrefixTable {
+  public:
+    // covers every MAC in [first, last] by splitting the range into aligned prefixes,
+    // inserting an existing prefix again replaces its entry.
+    // find only sees the inserted rules after build, so a batch of inserts compiles the trie once
+    void insert(MAC const& first, MAC const& last, std::string const& entry);
+    // compiles the trie if rules were inserted since the last build
+    void build();
+    std::string const* find(MAC const& mac) const;
+    size_t size() const { return rules.size(); }
+    // writes one prefix per line in the config file format, with @vlan when vlan is not 0
+    void write(std::ostream& out, uint16_t vlan) const;
+
+  private:
+    struct Rule {
+        uint64_t prefix;
+        uint8_t length;
+        std::string entry;
+    };
+    std::vector<Rule> rules;
+    // prefix << 8 | length -> index in rules
+    std::unordered_map<uint64_t, uint32_t> rule_index;
+    bool dirty = false;
+    // a slot is 0 for no match, CHILD | node index, or rule index + 1
+    static constexpr uint32_t CHILD = 1u << 31;
+    std::vector<std::array<uint32_t, 256>> nodes;
+    void compile(Rule const& rule, uint32_t value);
+};
+
+extern PrefixTable prefixEntries;
+
+// entries that only apply to frames tagged with one VLAN
+struct VlanEntries {
+    std::unordered_map<MAC, std::string> exact;
+    PrefixTable prefixes;
+};
+
+extern std::unordered_map<uint16_t, VlanEntries> vlanEntries;
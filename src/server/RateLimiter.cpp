@@ -0,0 +1,73 @@
+#include "RateLimiter.hpp"
+#include <chrono>
+#include <sstream>
+
+static constexpr uint64_t VALID_KEY = 1ull << 63;
+
+RateLimiter::RateLimiter(uint64_t suppress_ms, uint64_t rate, uint64_t burst)
+    : table(new Bucket[1 << BUCKET_BITS]()), suppress_ns(suppress_ms * 1000 * 1000) {
+    if (rate > 0) {
+        emission_interval_ns = 1000ull * 1000 * 1000 / rate;
+        burst_tolerance_ns = emission_interval_ns * (burst > 0 ? burst - 1 : 0);
+    }
+}
+
+bool RateLimiter::allow(MAC const& mac) {
+    uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    return allow(mac, now_ns);
+}
+
+bool RateLimiter::allow(MAC const& mac, uint64_t now_ns) {
+    Slot* slot = nullptr;
+    if (suppress(mac, now_ns, slot)) {
+        ++suppressed;
+        return false;
+    }
+    if (!take_token(now_ns)) {
+        // leave the client slot untouched so that its next retransmit can still be answered
+        ++dropped;
+        return false;
+    }
+    if (slot) slot->last_reply_ns = now_ns;
+    ++replies;
+    return true;
+}
+
+bool RateLimiter::suppress(MAC const& mac, uint64_t now_ns, Slot*& slot) {
+    if (suppress_ns == 0) return false;
+    uint64_t key = mac_to_u64(mac) | VALID_KEY;
+    // fibonacci hashing so that sequential MACs spread across buckets
+    Bucket& bucket = table[(key * 0x9E3779B97F4A7C15ull) >> (64 - BUCKET_BITS)];
+    Slot* oldest = &bucket.slots[0];
+    for (Slot& s : bucket.slots) {
+        if (s.key == key) {
+            slot = &s;
+            return now_ns - s.last_reply_ns < suppress_ns;
+        }
+        if (s.key == 0 || (oldest->key != 0 && s.last_reply_ns < oldest->last_reply_ns)) {
+            oldest = &s;
+        }
+    }
+    // evict the least recently answered client of this bucket
+    oldest->key = key;
+    oldest->last_reply_ns = 0;
+    slot = oldest;
+    return false;
+}
+
+bool RateLimiter::take_token(uint64_t now_ns) {
+    if (emission_interval_ns == 0) return true;
+    if (tat_ns > now_ns + burst_tolerance_ns) {
+        return false;
+    }
+    tat_ns = std::max(tat_ns, now_ns) + emission_interval_ns;
+    return true;
+}
+
+std::string RateLimiter::stats() const {
+    std::stringstream out;
+    out << "replies " << replies << "\n";
+    out << "suppressed " << suppressed << "\n";
+    out << "dropped " << dropped << "\n";
+    return out.str();
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "common.hpp"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Limits how often replies are sent.
+// Each client MAC gets at most one reply per suppress interval,
+// and all replies share a token bucket of rate replies/s with the given burst.
+// Client state lives in a fixed-size set associative table,
+// so a flood of spoofed source MACs evicts old clients instead of growing memory.
+class RateLimiter {
+  public:
+    RateLimiter(uint64_t suppress_ms, uint64_t rate, uint64_t burst);
+    bool allow(MAC const& mac);
+    bool allow(MAC const& mac, uint64_t now_ns);
+    std::string stats() const;
+    uint64_t replies = 0;
+    uint64_t suppressed = 0;
+    uint64_t dropped = 0;
+
+  private:
+    struct Slot {
+        // mac_to_u64 with the valid bit set, 0 when the slot is empty
+        uint64_t key;
+        uint64_t last_reply_ns;
+    };
+    static constexpr size_t WAYS = 4;
+    static constexpr size_t BUCKET_BITS = 10;
+    // one bucket is exactly one cache line
+    struct alignas(64) Bucket {
+        std::array<Slot, WAYS> slots;
+    };
+    std::unique_ptr<Bucket[]> table;
+    uint64_t suppress_ns;
+    // the token bucket is tracked as a theoretical arrival time (GCRA),
+    // which needs no periodic refill
+    uint64_t emission_interval_ns = 0;
+    uint64_t burst_tolerance_ns = 0;
+    uint64_t tat_ns = 0;
+    bool suppress(MAC const& mac, uint64_t now_ns, Slot*& slot);
+    bool take_token(uint64_t now_ns);
+};
@@ -1,39 +1,55 @@
 #include "RequestHandler.hpp"
+#include "LatencyTracer.hpp"
+#include "PeerHandler.hpp"
 #include "common.hpp"
 #include <arpa/inet.h>
+#include <array>
+#include <cinttypes>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
 #include <net/if.h>
+#include <optional>
+#include <sstream>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
-/*
-std::array<sock_filter, 4> filter_code = {
-    sock_filter{0x28, 0, 0, 0x0000000c       },
-    {0x15, 0, 1, ETHERTYPE        },
-    {0x6,  0, 0, sizeof(DataFrame)},
-    {0x6,  0, 0, 0x00000000       }
+// the socket receives every frame of the interface, so the VLAN tag is still in the auxdata,
+// this keeps only frames with our ethertype
+static std::array<sock_filter, 4> filter_code = {
+    sock_filter{0x28, 0, 0, 0x0000000c                  },
+    {0x15, 0, 1, ETHERTYPE                   },
+    {0x6,  0, 0, EventHandler::MAX_FRAME_SIZE},
+    {0x6,  0, 0, 0x00000000                  }
 };
 
-const sock_fprog filter = {
+static const sock_fprog filter = {
     .len = filter_code.size(),
-    .filter = &filter_code.at(0),
+    .filter = filter_code.data(),
 };
-*/
 
-RequestHandler::RequestHandler(EventHandler& eventHandler, MQTTHandler& mqttHandler, std::string const& interface)
-    : mqttHandler(mqttHandler) {
-    create_data_socket();
-    if (data_socket != -1) {
-        handler = std::bind(&RequestHandler::process_socket, this, std::placeholders::_1);
-        eventHandler.register_socket(data_socket, handler);
-    } else {
+RequestHandler::RequestHandler(EventHandler& eventHandler, MQTTHandler& mqttHandler, RateLimiter& rateLimiter, std::string const& interface,
+                               int existing_socket)
+    : data_socket(existing_socket), eventHandler(eventHandler), mqttHandler(mqttHandler), rateLimiter(rateLimiter) {
+    if (data_socket == -1) {
+        create_data_socket();
+    }
+    if (data_socket == -1) {
         std::cout << "error: failed to create data socket: " << strerror(errno) << std::endl;
         exit(errno);
     }
+    // a socket handed over by an older process gets the options of this binary
+    configure_data_socket();
     get_if_info(interface);
+    if (existing_socket == -1) {
+        bind_data_socket();
+    }
+    handler = std::bind(&RequestHandler::process_frame, this, std::placeholders::_1);
+    eventHandler.register_receiver(data_socket, handler);
 }
 
 RequestHandler::~RequestHandler() {
@@ -43,20 +59,47 @@ RequestHandler::~RequestHandler() {
 }
 
 void RequestHandler::create_data_socket() {
-    data_socket = socket(AF_PACKET, SOCK_RAW, htons(ETHERTYPE));
-    if (data_socket != -1) {
-        /*
-        drain_socket(data_socket);
-        if (setsockopt(data_socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) != 0) {
-            std::cout << "error: failed to attach data socket filter: " << strerror(errno) << std::endl;
-            exit(errno);
-        }
-        */
-    } else {
+    // protocol 0 receives nothing until the socket is bound, so no unfiltered frames are queued
+    data_socket = socket(AF_PACKET, SOCK_RAW, 0);
+    if (data_socket == -1) {
         std::cout << "error: failed to create L2 socket: " << strerror(errno) << std::endl;
     }
 }
 
+void RequestHandler::configure_data_socket() {
+    // attaching replaces the filter of an inherited socket
+    if (setsockopt(data_socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) != 0) {
+        std::cout << "error: failed to attach data socket filter: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+    // the VLAN tag of a received frame is stripped and passed in a PACKET_AUXDATA control message
+    int enable = 1;
+    if (setsockopt(data_socket, SOL_PACKET, PACKET_AUXDATA, &enable, sizeof(enable)) == -1) {
+        std::cout << "error: failed to enable packet auxdata: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+    // timestamps and busy polling are off until enable_timestamps and enable_busy_poll,
+    // so they do not stay on from an older process that was started with other options
+    int disable = 0;
+    if (setsockopt(data_socket, SOL_SOCKET, SO_TIMESTAMPING, &disable, sizeof(disable)) == -1 ||
+        setsockopt(data_socket, SOL_SOCKET, SO_BUSY_POLL, &disable, sizeof(disable)) == -1) {
+        std::cout << "warning: failed to reset data socket options: " << strerror(errno) << std::endl;
+    }
+}
+
+void RequestHandler::bind_data_socket() {
+    // ETH_P_ALL sockets see tagged frames before the kernel drops the tag of VLANs without a device,
+    // binding to the interface keeps out the frames of other interfaces
+    sockaddr_ll addr = {};
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = ifindex;
+    if (bind(data_socket, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        std::cout << "error: failed to bind data socket: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+}
+
 void RequestHandler::get_if_info(std::string const& interface) {
     ifreq ifr = {};
     if (interface.size() < sizeof(ifr.ifr_name)) {
@@ -80,74 +123,187 @@ void RequestHandler::get_if_info(std::string const& interface) {
     memcpy(hwaddr.data(), ifr.ifr_hwaddr.sa_data, hwaddr.size());
 }
 
-void RequestHandler::process_socket(uint32_t /*events*/) {
-    size_t bufsize = 0;
-    if (ioctl(data_socket, FIONREAD, &bufsize) < 0) {
-        std::cout << "warning: failed to get buffer size for data socket: " << strerror(errno) << std::endl;
+void RequestHandler::send_frame(void const* frame, size_t size, VlanTag const& tag) {
+    sockaddr_ll addr = {};
+    addr.sll_family = AF_PACKET;
+    addr.sll_ifindex = ifindex;
+    addr.sll_halen = ETHER_ADDR_LEN;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    // NOTE:
+    // sll_addr probably doesn't matter, because it's set in the header
+    std::memcpy(addr.sll_addr, frame, sizeof(MAC));
+    if (tag.tpid == 0) {
+        eventHandler.send(data_socket, frame, size, addr);
+        return;
+    }
+    // the tag goes between the source address and the ethertype
+    unsigned char tagged[EventHandler::MAX_FRAME_SIZE];
+    if (size < sizeof(ethhdr) || size + VLAN_TAG_SIZE > sizeof(tagged)) {
+        return;
+    }
+    uint16_t vlan_header[2] = {htons(tag.tpid), htons(tag.tci)};
+    size_t addresses_size = offsetof(ethhdr, h_proto);
+    std::memcpy(tagged, frame, addresses_size);
+    std::memcpy(tagged + addresses_size, vlan_header, VLAN_TAG_SIZE);
+    std::memcpy(tagged + addresses_size + VLAN_TAG_SIZE, static_cast<unsigned char const*>(frame) + addresses_size, size - addresses_size);
+    eventHandler.send(data_socket, tagged, size + VLAN_TAG_SIZE, addr);
+}
+
+void RequestHandler::join_group(MAC const& group) {
+    packet_mreq mreq = {};
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_MULTICAST;
+    mreq.mr_alen = group.size();
+    std::memcpy(mreq.mr_address, group.data(), group.size());
+    if (setsockopt(data_socket, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1) {
+        std::cout << "error: failed to join multicast group: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+}
+
+void RequestHandler::enable_busy_poll(int usec) {
+    if (setsockopt(data_socket, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1) {
+        std::cout << "warning: failed to enable busy poll: " << strerror(errno) << std::endl;
+    }
+}
+
+void RequestHandler::enable_timestamps() {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(data_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1) {
+        std::cout << "warning: failed to enable timestamps: " << strerror(errno) << std::endl;
+    }
+}
+
+static VlanTag read_vlan_tag(msghdr const& msg) {
+    VlanTag tag;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&msg), cmsg)) {
+        if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_AUXDATA) {
+            tpacket_auxdata aux;
+            std::memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
+            if (aux.tp_status & TP_STATUS_VLAN_VALID) {
+                tag.tpid = (aux.tp_status & TP_STATUS_VLAN_TPID_VALID) ? aux.tp_vlan_tpid : ETH_P_8021Q;
+                tag.tci = aux.tp_vlan_tci;
+            }
+        }
+    }
+    return tag;
+}
+
+void RequestHandler::process_frame(ReceivedFrame const& frame) {
+    if (frame.error_queue) {
+        if (tracer) tracer->transmitted(frame.data, frame.size, frame.msg);
         return;
     }
-    std::vector<unsigned char> frame(bufsize);
-    int r = recv(data_socket, frame.data(), bufsize, 0);
-    if (r == -1) {
-        std::cout << "warning: failed to receive frame: " << strerror(errno) << std::endl;
+    // packet sockets also see the frames we send, and unicasts to other hosts on a promiscuous or loopback interface
+    if (frame.from.sll_pkttype == PACKET_OUTGOING || frame.from.sll_pkttype == PACKET_OTHERHOST || frame.size < sizeof(ethhdr)) {
         return;
-    } else if (r != (int)bufsize) {
-        std::cout << "warning: unexpected frame receive size: " << r << std::endl;
+    }
+    if (std::memcmp(frame.data, peer_group_addr.data(), peer_group_addr.size()) == 0) {
+        if (peerHandler) peerHandler->process_heartbeat(frame.data, frame.size);
         return;
     }
     // NOTE:
     // handling the case where the L2 packet was extended to 60 bytes
-    if (bufsize == sizeof(RequestFrame) || (bufsize > sizeof(RequestFrame) && frame[sizeof(RequestFrame)] == '\0')) {
-        process_request(frame);
+    if (frame.size == sizeof(RequestFrame) || (frame.size > sizeof(RequestFrame) && frame.data[sizeof(RequestFrame)] == '\0')) {
+        process_request(frame, read_vlan_tag(frame.msg), false);
+    } else if (frame.data[sizeof(RequestFrame)] == COMBINED_REQUEST) {
+        process_request(frame, read_vlan_tag(frame.msg), true);
     } else {
-        process_menuentries(frame);
+        process_menuentries(frame.data, frame.size);
     }
 }
 
-void RequestHandler::process_request(std::vector<unsigned char> const& frame) {
+void RequestHandler::process_request(ReceivedFrame const& frame, VlanTag const& tag, bool combined) {
     RequestFrame source_frame = {};
-    std::memcpy(&source_frame, frame.data(), sizeof(source_frame));
-    // check that it is a broadcast packet
-    if (memcmp(source_frame.hdr.h_dest, ether_broadcast_addr.data(), ether_broadcast_addr.size()) != 0) {
+    std::memcpy(&source_frame, frame.data, sizeof(source_frame));
+    // check that it is a broadcast packet, or a unicast to this server from a client that cached it
+    bool unicast = memcmp(source_frame.hdr.h_dest, hwaddr.data(), hwaddr.size()) == 0;
+    if (!unicast && memcmp(source_frame.hdr.h_dest, ether_broadcast_addr.data(), ether_broadcast_addr.size()) != 0) {
         return;
     }
 
     MAC src_addr = {};
     std::memcpy(src_addr.data(), source_frame.hdr.h_source, src_addr.size());
-    auto entryIt = defaultEntries.find(src_addr);
-    if (entryIt != defaultEntries.end()) {
-        std::string& entry = entryIt->second;
+    // the owner of a client is decided before the lookup, so a miss is reported by the owner instead of silently by everyone.
+    // only this server sees a unicast request, so it answers regardless of the shard
+    if (!unicast && peerHandler && !peerHandler->is_responder(src_addr)) {
+        return;
+    }
+    if (tracer) tracer->request(src_addr, frame.msg);
+    std::string const* entryPtr = find_entry(src_addr, tag.vid());
+    if (entryPtr) {
+        std::string const& entry = *entryPtr;
         if (entry.size() > MAX_ENTRY_LENGTH) {
-            std::cout << "error: entry for ";
-            print_mac(src_addr);
-            std::cout << " is too large: " << entry.size() << std::endl;
+            if (count(oversized)) {
+                char mac_str[MAC_STR_SIZE];
+                format_mac(src_addr, mac_str);
+                printf("error: entry for %s is too large: %zu (%" PRIu64 " in total)\n", mac_str, entry.size(), oversized.count);
+                fflush(stdout);
+            }
             return;
         }
-
-        DataFrame data = {};
-        data.hdr = source_frame.hdr;
-        std::memcpy(data.hdr.h_dest, source_frame.hdr.h_source, sizeof(MAC));
-        std::memcpy(data.hdr.h_source, hwaddr.data(), sizeof(MAC));
-        data.entry_length = entry.size();
-        std::memcpy(data.entry, entry.data(), data.entry_length);
-        size_t send_size = offsetof(DataFrame, entry) + data.entry_length;
-
-        sockaddr_ll addr = {};
-        addr.sll_family = AF_PACKET;
-        addr.sll_ifindex = ifindex;
-        addr.sll_halen = ETHER_ADDR_LEN;
-        addr.sll_protocol = htons(ETH_P_ALL);
-        // NOTE:
-        // sll_addr probably doesn't matter, because it's set in the header
-        std::memcpy(addr.sll_addr, data.hdr.h_dest, sizeof(MAC));
-        if (sendto(data_socket, &data, send_size, 0, (const sockaddr*)&addr, (socklen_t)sizeof(addr)) == -1) {
-            std::cout << "failed to send packet: " << strerror(errno) << std::endl;
+        // only the owner of the client gets here, and a retransmit is checked against its cached menu without parsing it
+        Menu const* menu = combined ? ingest_menu(src_addr, frame.data, frame.size) : nullptr;
+        if (menu && !menu->contains(entry)) {
+            if (count(not_in_menu)) {
+                char mac_str[MAC_STR_SIZE];
+                format_mac(src_addr, mac_str);
+                printf("warning: entry %s for %s is not in its menu (%" PRIu64 " in total)\n", entry.c_str(), mac_str, not_in_menu.count);
+                fflush(stdout);
+            }
+            return;
+        }
+        // the limiter only counts requests that are answered
+        if (!rateLimiter.allow(src_addr)) {
+            return;
         }
+
+        DataFrame data;
+        size_t send_size = build_reply(source_frame.hdr, hwaddr, entry, data);
+        if (tracer) tracer->reply();
+        // replies go out with the tag of the request
+        send_frame(&data, send_size, tag);
     } else {
-        std::cout << "failed to find entry for MAC: ";
-        print_mac(src_addr);
-        std::cout << std::endl;
+        // a client without an entry still exports its menu, so one can be picked for it
+        if (combined) ingest_menu(src_addr, frame.data, frame.size);
+        // the request path does not allocate, so no iostream formatting here
+        if (count(misses)) {
+            char mac_str[MAC_STR_SIZE];
+            format_mac(src_addr, mac_str);
+            printf("failed to find entry for MAC: %s (%" PRIu64 " in total)\n", mac_str, misses.count);
+            fflush(stdout);
+        }
+    }
+}
+
+bool RequestHandler::count(LogCounter& counter) {
+    ++counter.count;
+    // the coarse clock is read from the vDSO without a syscall
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    uint64_t now_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+    if (now_ns < counter.next_log_ns) {
+        return false;
     }
+    counter.next_log_ns = now_ns + LOG_INTERVAL_NS;
+    return true;
+}
+
+std::string RequestHandler::stats() const {
+    std::stringstream out;
+    out << "misses " << misses.count << "\n";
+    out << "oversized " << oversized.count << "\n";
+    out << "not_in_menu " << not_in_menu.count << "\n";
+    return out.str();
+}
+
+size_t build_reply(ethhdr const& request, MAC const& hwaddr, std::string const& entry, DataFrame& reply) {
+    reply.hdr = request;
+    std::memcpy(reply.hdr.h_dest, request.h_source, sizeof(MAC));
+    std::memcpy(reply.hdr.h_source, hwaddr.data(), sizeof(MAC));
+    reply.entry_length = entry.size();
+    std::memcpy(reply.entry, entry.data(), reply.entry_length);
+    return offsetof(DataFrame, entry) + reply.entry_length;
 }
 
 std::optional<std::string> read_strnlen(const char*& strbuf, int& remaining_len) {
@@ -168,14 +324,10 @@ std::optional<std::string> read_strnlen(const char*& strbuf, int& remaining_len)
     return str;
 }
 
-void RequestHandler::process_menuentries(std::vector<unsigned char> const& frame) {
-    ethhdr hdr;
-    std::memcpy(&hdr, frame.data(), sizeof(hdr));
-
-    const char* entry = reinterpret_cast<const char*>(frame.data()) + sizeof(hdr);
-    int remaining_len = frame.size() - sizeof(hdr);
+bool parse_menuentries(unsigned char const* frame, size_t size, std::unordered_map<std::string, std::string>& menuentries, size_t offset) {
+    const char* entry = reinterpret_cast<const char*>(frame) + offset;
+    int remaining_len = size - offset;
 
-    std::unordered_map<std::string, std::string> menuentries;
     while (remaining_len != 0 && *entry != '\0') {
         auto id = read_strnlen(entry, remaining_len);
         auto title = read_strnlen(entry, remaining_len);
@@ -184,11 +336,68 @@ void RequestHandler::process_menuentries(std::vector<unsigned char> const& frame
             menuentries[id.value()] = title.value();
         } else {
             std::cout << "warning: process_menuentries: invalid id or title read" << std::endl;
-            return;
+            return false;
         }
     }
+    return true;
+}
+
+void RequestHandler::process_menuentries(unsigned char const* frame, size_t size) {
+    ethhdr hdr;
+    std::memcpy(&hdr, frame, sizeof(hdr));
+
+    std::unordered_map<std::string, std::string> menuentries;
+    if (!parse_menuentries(frame, size, menuentries)) {
+        return;
+    }
 
     MAC mac = {};
     std::memcpy(mac.data(), hdr.h_source, mac.size());
-    mqttHandler.upload_menuentries(mac, menuentries);
+    mqttHandler.upload_menuentries(mac, std::move(menuentries));
+}
+
+RequestHandler::Menu const* RequestHandler::ingest_menu(MAC const& client, unsigned char const* frame, size_t size) {
+    // retransmits of a request carry the same menu, which is only parsed and uploaded once
+    size_t offset = sizeof(RequestFrame) + sizeof(COMBINED_REQUEST);
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = offset; i < size; ++i) {
+        hash = (hash ^ frame[i]) * 0x100000001b3ull;
+    }
+    auto menuIt = menus.find(client);
+    if (menuIt != menus.end() && menuIt->second.hash == hash) {
+        return &menuIt->second;
+    }
+
+    std::unordered_map<std::string, std::string> menuentries;
+    if (!parse_menuentries(frame, size, menuentries, offset) || menuentries.empty()) {
+        return nullptr;
+    }
+    if (menuIt == menus.end()) {
+        if (menus.size() >= MAX_MENUS) {
+            // the bucket of the new client picks the evicted menu, so a flood of spoofed MACs evicts random clients
+            size_t bucket = menus.bucket(client);
+            while (menus.bucket_size(bucket) == 0) {
+                bucket = (bucket + 1) % menus.bucket_count();
+            }
+            MAC evicted = menus.begin(bucket)->first;
+            menus.erase(evicted);
+        }
+        menuIt = menus.try_emplace(client).first;
+    }
+    Menu& menu = menuIt->second;
+    menu.hash = hash;
+    menu.entries.assign(menuentries.begin(), menuentries.end());
+    mqttHandler.upload_menuentries(client, std::move(menuentries));
+    return &menu;
+}
+
+bool RequestHandler::Menu::contains(std::string const& entry) const {
+    // grub also accepts a title, a menu index or a path into a submenu, which are not exported
+    if (entry.find('>') != std::string::npos || entry.find_first_not_of("0123456789") == std::string::npos) {
+        return true;
+    }
+    for (auto const& [id, title] : entries) {
+        if (entry == id || entry == title) return true;
+    }
+    return false;
 }
@@ -1,24 +1,81 @@
 #pragma once
 #include "EventHandler.hpp"
 #include "MQTTHandler.hpp"
+#include "RateLimiter.hpp"
 #include "common.hpp"
+#include <optional>
 #include <string>
 #include <sys/socket.h>
+#include <utility>
+#include <vector>
+
+class LatencyTracer;
+class PeerHandler;
+
+const size_t VLAN_TAG_SIZE = 4;
+
+// reads one null terminated string and advances strbuf past it
+std::optional<std::string> read_strnlen(const char*& strbuf, int& remaining_len);
+// parses the id\0title\0 pairs of an export frame, which start at offset
+bool parse_menuentries(unsigned char const* frame, size_t size, std::unordered_map<std::string, std::string>& menuentries,
+                       size_t offset = sizeof(ethhdr));
+// fills reply with the answer to request and returns the number of bytes to send
+size_t build_reply(ethhdr const& request, MAC const& hwaddr, std::string const& entry, DataFrame& reply);
 
 class RequestHandler {
   public:
-    RequestHandler(EventHandler& eventHandler, MQTTHandler& mqttHandler, std::string const& interface);
+    // existing_socket is used instead of a new packet socket when it is not -1
+    RequestHandler(EventHandler& eventHandler, MQTTHandler& mqttHandler, RateLimiter& rateLimiter, std::string const& interface,
+                   int existing_socket = -1);
     ~RequestHandler();
+    // a frame with a tpid is sent with that 802.1Q tag
+    void send_frame(void const* frame, size_t size, VlanTag const& tag = {});
+    void join_group(MAC const& group);
+    // lets the kernel busy poll the device queue for up to usec before sleeping in receive
+    void enable_busy_poll(int usec);
+    // software RX and TX timestamps for the tracer, TX timestamps are read from the error queue
+    void enable_timestamps();
+    MAC const& get_hwaddr() const { return hwaddr; }
+    int get_socket() const { return data_socket; }
+    // counts of the requests that were not answered because of the entry
+    std::string stats() const;
+    PeerHandler* peerHandler = nullptr;
+    LatencyTracer* tracer = nullptr;
 
   private:
     void create_data_socket();
+    void configure_data_socket();
+    void bind_data_socket();
     int data_socket = -1;
-    std::function<void(uint32_t)> handler;
+    std::function<void(ReceivedFrame const&)> handler;
     MAC hwaddr = {};
     int ifindex = -1;
     void get_if_info(std::string const& interface);
-    void process_socket(uint32_t events);
-    void process_request(std::vector<unsigned char> const& frame);
-    void process_menuentries(std::vector<unsigned char> const& frame);
+    void process_frame(ReceivedFrame const& frame);
+    void process_request(ReceivedFrame const& frame, VlanTag const& tag, bool combined);
+    void process_menuentries(unsigned char const* frame, size_t size);
+    // the last menu of each client that sent a combined request
+    struct Menu {
+        uint64_t hash;
+        std::vector<std::pair<std::string, std::string>> entries;
+        bool contains(std::string const& entry) const;
+    };
+    std::unordered_map<MAC, Menu> menus;
+    // evicts one menu when this many clients sent one, so spoofed source MACs cannot grow it without bound
+    static constexpr size_t MAX_MENUS = 4096;
+    Menu const* ingest_menu(MAC const& client, unsigned char const* frame, size_t size);
+    // problems on the request path are counted and logged at most once per LOG_INTERVAL_NS,
+    // so retransmits of a misconfigured client do not cost a blocking write each
+    struct LogCounter {
+        uint64_t count = 0;
+        uint64_t next_log_ns = 0;
+    };
+    LogCounter misses;
+    LogCounter oversized;
+    LogCounter not_in_menu;
+    static constexpr uint64_t LOG_INTERVAL_NS = 1000000000;
+    static bool count(LogCounter& counter);
+    EventHandler& eventHandler;
     MQTTHandler& mqttHandler;
+    RateLimiter& rateLimiter;
 };
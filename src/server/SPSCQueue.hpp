@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// Bounded lock free queue between exactly one producer thread and one consumer thread.
+// Each side caches the other side's index, so the shared cache lines are only touched when the cache looks full or empty.
+// The slots are allocated once on construction, so a large queue does not end up on the stack of its owner.
+template <typename T, size_t Capacity> class SPSCQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+  public:
+    SPSCQueue() : slots(std::make_unique<T[]>(Capacity)) {}
+
+    // producer only, returns false when the queue is full
+    bool push(T&& value) {
+        size_t write = tail.load(std::memory_order_relaxed);
+        if (write - cached_head >= Capacity) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (write - cached_head >= Capacity) {
+                return false;
+            }
+        }
+        slots[write & (Capacity - 1)] = std::move(value);
+        tail.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only, returns false when the queue is empty
+    bool pop(T& value) {
+        size_t read = head.load(std::memory_order_relaxed);
+        if (read == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (read == cached_tail) {
+                return false;
+            }
+        }
+        value = std::move(slots[read & (Capacity - 1)]);
+        head.store(read + 1, std::memory_order_release);
+        return true;
+    }
+
+    // safe from any thread, the result may be stale
+    size_t size() const {
+        size_t read = head.load(std::memory_order_acquire);
+        return tail.load(std::memory_order_acquire) - read;
+    }
+
+  private:
+    alignas(64) std::atomic<size_t> head = 0;
+    size_t cached_tail = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+    size_t cached_head = 0;
+    alignas(64) std::unique_ptr<T[]> slots;
+};
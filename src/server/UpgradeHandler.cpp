@@ -0,0 +1,227 @@
+#include "UpgradeHandler.hpp"
+#include "ConfigHandler.hpp"
+#include "common.hpp"
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static constexpr size_t HANDOFF_FDS = 3;
+
+static bool make_address(std::string const& path, sockaddr_un& addr) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() + 1 > sizeof(addr.sun_path)) {
+        std::cout << "error: size of upgrade socket path is > " << sizeof(addr.sun_path) << std::endl;
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.data(), path.size());
+    addr.sun_path[path.size()] = '\0';
+    return true;
+}
+
+bool UpgradeHandler::receive_handoff(std::string const& path, Handoff& handoff) {
+    sockaddr_un addr;
+    if (!make_address(path, addr)) {
+        return false;
+    }
+    int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection == -1) {
+        std::cout << "warning: failed to create upgrade socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+    // no process is running when nothing listens on the path
+    if (connect(connection, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(connection);
+        return false;
+    }
+
+    char marker;
+    iovec iov = {&marker, sizeof(marker)};
+    alignas(cmsghdr) unsigned char control[CMSG_SPACE(HANDOFF_FDS * sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(connection, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        std::cout << "warning: failed to receive the sockets of the running process: " << strerror(errno) << std::endl;
+        close(connection);
+        return false;
+    }
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(HANDOFF_FDS * sizeof(int))) {
+        std::cout << "warning: the running process sent no sockets" << std::endl;
+        close(connection);
+        return false;
+    }
+    int fds[HANDOFF_FDS];
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    handoff = {connection, fds[0], fds[1], fds[2]};
+    return true;
+}
+
+void UpgradeHandler::finish_handoff(Handoff& handoff, ConfigHandler& configHandler) {
+    std::string entries;
+    char buffer[4096];
+    ssize_t r;
+    while ((r = pread(handoff.entries, buffer, sizeof(buffer), entries.size())) > 0) {
+        entries.append(buffer, r);
+    }
+    close(handoff.entries);
+    // the old process already published its entries
+    std::stringstream stream(entries);
+    configHandler.process_config(stream, false);
+
+    // the old process confirms that it stops, if it gave up waiting for the ack it keeps serving and this one exits,
+    // so the two never serve at the same time
+    char ack = 1;
+    if (send(handoff.connection, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack)) {
+        std::cout << "error: failed to acknowledge the handoff: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+    timeval timeout = {ACK_TIMEOUT_S, 0};
+    setsockopt(handoff.connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char confirm;
+    if (recv(handoff.connection, &confirm, sizeof(confirm), 0) != sizeof(confirm)) {
+        std::cout << "error: the running process did not hand over, exiting" << std::endl;
+        exit(ECONNABORTED);
+    }
+    close(handoff.connection);
+    handoff = {};
+}
+
+UpgradeHandler::UpgradeHandler(EventHandler& eventHandler, std::string const& path, int data_socket, int config_socket)
+    : eventHandler(eventHandler), data_socket(data_socket), config_socket(config_socket) {
+    create_socket(path);
+    handler = std::bind(&UpgradeHandler::process_socket, this, std::placeholders::_1);
+    ack_handler = std::bind(&UpgradeHandler::process_ack, this, std::placeholders::_1);
+    timeout_handler = std::bind(&UpgradeHandler::process_timeout, this, std::placeholders::_1);
+    eventHandler.register_socket(listen_socket, handler);
+}
+
+UpgradeHandler::~UpgradeHandler() {
+    // the path belongs to the new process after a handoff, so it is not unlinked
+    if (listen_socket != -1) {
+        close(listen_socket);
+    }
+    if (connection != -1) {
+        end_handoff();
+    }
+}
+
+void UpgradeHandler::create_socket(std::string const& path) {
+    sockaddr_un addr;
+    if (!make_address(path, addr)) {
+        exit(EINVAL);
+    }
+    listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_socket == -1) {
+        std::cout << "error: failed to create upgrade socket: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+    // a running process that handed off keeps its socket open, but the path is taken over
+    unlink(path.data());
+    if (bind(listen_socket, (sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_socket, 1) == -1) {
+        std::cout << "error: failed to listen on upgrade socket: " << path << " : " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+}
+
+void UpgradeHandler::process_socket(uint32_t /*events*/) {
+    int accepted = accept4(listen_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (accepted == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            std::cout << "warning: failed to accept upgrade connection: " << strerror(errno) << std::endl;
+        }
+        return;
+    }
+    // the sockets are only handed to one process at a time
+    if (connection != -1) {
+        std::cout << "warning: an upgrade is already in progress" << std::endl;
+        close(accepted);
+        return;
+    }
+
+    std::stringstream table;
+    write_entries(table);
+    std::string entries_str = table.str();
+    int entries = memfd_create("remote-bootselect-entries", MFD_CLOEXEC);
+    if (entries == -1 || write(entries, entries_str.data(), entries_str.size()) != static_cast<ssize_t>(entries_str.size())) {
+        std::cout << "warning: failed to write the entries for the upgrade: " << strerror(errno) << std::endl;
+        if (entries != -1) close(entries);
+        close(accepted);
+        return;
+    }
+
+    char marker = 0;
+    iovec iov = {&marker, sizeof(marker)};
+    alignas(cmsghdr) unsigned char control[CMSG_SPACE(HANDOFF_FDS * sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(HANDOFF_FDS * sizeof(int));
+    int fds[HANDOFF_FDS] = {data_socket, config_socket, entries};
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    bool sent = sendmsg(accepted, &msg, MSG_NOSIGNAL) == 1;
+    close(entries);
+    if (!sent) {
+        std::cout << "warning: failed to send the sockets for the upgrade: " << strerror(errno) << std::endl;
+        close(accepted);
+        return;
+    }
+
+    // requests are served while the new process loads the entries, the ack or the timeout ends the handoff
+    timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer == -1) {
+        std::cout << "warning: failed to create upgrade timer: " << strerror(errno) << std::endl;
+        close(accepted);
+        return;
+    }
+    itimerspec ts = {};
+    ts.it_value.tv_sec = ACK_TIMEOUT_S;
+    timerfd_settime(timer, 0, &ts, nullptr);
+    connection = accepted;
+    eventHandler.register_socket(connection, ack_handler);
+    eventHandler.register_socket(timer, timeout_handler);
+}
+
+void UpgradeHandler::process_ack(uint32_t /*events*/) {
+    char ack;
+    ssize_t r = recv(connection, &ack, sizeof(ack), 0);
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    char confirm = 1;
+    if (r == sizeof(ack) && send(connection, &confirm, sizeof(confirm), MSG_NOSIGNAL) == sizeof(confirm)) {
+        std::cout << "handed over to the new process, exiting" << std::endl;
+        end_handoff();
+        eventHandler.stop();
+    } else {
+        std::cout << "warning: the upgrade was not acknowledged, continuing to serve" << std::endl;
+        end_handoff();
+    }
+}
+
+void UpgradeHandler::process_timeout(uint32_t /*events*/) {
+    std::cout << "warning: the upgrade was not acknowledged in time, continuing to serve" << std::endl;
+    end_handoff();
+}
+
+void UpgradeHandler::end_handoff() {
+    eventHandler.unregister_socket(connection);
+    eventHandler.unregister_socket(timer);
+    close(connection);
+    close(timer);
+    connection = -1;
+    timer = -1;
+}
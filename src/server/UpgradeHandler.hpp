@@ -0,0 +1,48 @@
+#pragma once
+#include "EventHandler.hpp"
+#include <functional>
+#include <string>
+
+class ConfigHandler;
+
+// Hands the sockets and entries of the running process to a new one, so requests are answered through a restart.
+// The running process listens on a unix stream socket. A new process started with the same path connects to it
+// and receives the data socket, the config socket and a memfd with the entries in the config file format (SCM_RIGHTS).
+// Frames that arrive during the handoff wait in the shared data socket,
+// and the old process stops once the new one acknowledges that it has loaded the entries.
+// The old process confirms the ack before it stops, a new process that gets no confirmation exits instead of serving.
+class UpgradeHandler {
+  public:
+    struct Handoff {
+        int connection = -1;
+        int data_socket = -1;
+        int config_socket = -1;
+        int entries = -1;
+    };
+    // connects to the process listening on path and receives its sockets, false if no process is listening
+    static bool receive_handoff(std::string const& path, Handoff& handoff);
+    // loads the entries of the old process and lets it exit, exits if the old process does not hand over
+    static void finish_handoff(Handoff& handoff, ConfigHandler& configHandler);
+
+    UpgradeHandler(EventHandler& eventHandler, std::string const& path, int data_socket, int config_socket);
+    ~UpgradeHandler();
+    void process_socket(uint32_t events);
+
+  private:
+    EventHandler& eventHandler;
+    int listen_socket = -1;
+    int data_socket;
+    int config_socket;
+    // the connection of the handoff in progress and its ack timeout
+    int connection = -1;
+    int timer = -1;
+    std::function<void(uint32_t)> handler;
+    std::function<void(uint32_t)> ack_handler;
+    std::function<void(uint32_t)> timeout_handler;
+    void create_socket(std::string const& path);
+    void process_ack(uint32_t events);
+    void process_timeout(uint32_t events);
+    void end_handoff();
+    // how long the old process waits for the new one before it continues serving
+    static constexpr int ACK_TIMEOUT_S = 10;
+};
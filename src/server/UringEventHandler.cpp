@@ -0,0 +1,291 @@
+#include "UringEventHandler.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// user_data is the kind of operation in the top byte and its index below
+enum : uint64_t { OP_POLL = 1, OP_RECV = 2, OP_SEND = 3, OP_CANCEL = 4 };
+static uint64_t user_data(uint64_t op, uint64_t idx) { return (op << 56) | idx; }
+
+static int io_uring_setup(unsigned entries, io_uring_params* params) { return syscall(__NR_io_uring_setup, entries, params); }
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void* map_ring(int fd, size_t size, off_t offset) {
+    void* ring = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (ring == MAP_FAILED) {
+        std::cout << "error: failed to map io_uring: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+    return ring;
+}
+
+UringEventHandler::UringEventHandler() {
+    io_uring_params params = {};
+    ring_fd = io_uring_setup(RING_ENTRIES, &params);
+    if (ring_fd == -1) {
+        std::cout << "error: io_uring_setup failed: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = map_ring(ring_fd, sq_ring_size, IORING_OFF_SQ_RING);
+    cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring : map_ring(ring_fd, cq_ring_size, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(map_ring(ring_fd, sqes_size, IORING_OFF_SQES));
+
+    auto sq = static_cast<unsigned char*>(sq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    // SQEs are always used in ring order, so the index array is the identity
+    auto sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+    auto cq = static_cast<unsigned char*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    buf_ring_size = RECV_BUFFERS * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        std::cout << "error: failed to allocate io_uring buffer ring: " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+    buf_ring = static_cast<io_uring_buf_ring*>(ring);
+    io_uring_buf_reg reg = {};
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+    if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        std::cout << "error: failed to register io_uring buffer ring (needs linux 6.0): " << strerror(errno) << std::endl;
+        exit(errno);
+    }
+    recv_buffers.resize(RECV_BUFFERS * RECV_BUFFER_SIZE);
+    for (uint16_t bid = 0; bid < RECV_BUFFERS; ++bid) {
+        recycle_buffer(bid);
+    }
+
+    for (unsigned i = 0; i < SEND_SLOTS; ++i) {
+        free_send_slots.push_back(i);
+    }
+}
+
+UringEventHandler::~UringEventHandler() {
+    if (ring_fd != -1) {
+        close(ring_fd);
+    }
+    if (buf_ring) munmap(buf_ring, buf_ring_size);
+    if (sqes) munmap(sqes, sqes_size);
+    if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring) munmap(sq_ring, sq_ring_size);
+}
+
+void UringEventHandler::recycle_buffer(uint16_t bid) {
+    // bufs is declared as a flexible array member, which C++ places at the wrong offset
+    io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(buf_ring)[buf_tail & (RECV_BUFFERS - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(recv_buffers.data() + bid * RECV_BUFFER_SIZE);
+    buf.len = RECV_BUFFER_SIZE;
+    buf.bid = bid;
+    ++buf_tail;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* UringEventHandler::get_sqe() {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_mask) {
+        // the submission queue is full, hand it to the kernel first
+        submit(0);
+    }
+    io_uring_sqe* sqe = &sqes[tail & sq_mask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++pending_submissions;
+    return sqe;
+}
+
+void UringEventHandler::submit(unsigned wait) {
+    int r = io_uring_enter(ring_fd, pending_submissions, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (r == -1) {
+        if (errno != EINTR) {
+            std::cout << "warning: io_uring_enter failed: " << strerror(errno) << std::endl;
+        }
+        return;
+    }
+    pending_submissions -= std::min<unsigned>(r, pending_submissions);
+}
+
+void UringEventHandler::register_socket(int socket, std::function<void(uint32_t)>& f, uint32_t events) {
+    polls.push_back(Poll{socket, events, &f});
+    arm_poll(polls.size() - 1);
+}
+
+void UringEventHandler::unregister_socket(int socket) {
+    for (size_t idx = 0; idx < polls.size(); ++idx) {
+        if (polls[idx].socket != socket || !polls[idx].f) continue;
+        polls[idx].f = nullptr;
+        // the poll is pending unless its handler is running, then it is just not re-armed
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = user_data(OP_POLL, idx);
+        sqe->user_data = user_data(OP_CANCEL, idx);
+    }
+}
+
+void UringEventHandler::arm_poll(size_t idx) {
+    // one shot polls are re-armed after the handler ran, which gives the level triggered behaviour of epoll
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = polls[idx].socket;
+    // POLL* and EPOLL* share their values
+    sqe->poll32_events = polls[idx].events;
+    sqe->user_data = user_data(OP_POLL, idx);
+}
+
+void UringEventHandler::register_receiver(int socket, std::function<void(ReceivedFrame const&)>& f) {
+    Receiver& receiver = receivers.emplace_back(Receiver{socket, {}, &f, {}});
+    receiver.msg.msg_namelen = sizeof(sockaddr_ll);
+    receiver.msg.msg_controllen = CONTROL_SIZE;
+    receiver_index.push_back(&receiver);
+    arm_receiver(receiver_index.size() - 1);
+    receiver.error_poll = [this, socket, &f](uint32_t /*events*/) { receive_error_queue(socket, f); };
+    register_socket(socket, receiver.error_poll, EPOLLERR);
+}
+
+void UringEventHandler::arm_receiver(size_t idx) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = receiver_index[idx]->socket;
+    sqe->addr = reinterpret_cast<uint64_t>(&receiver_index[idx]->msg);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = user_data(OP_RECV, idx);
+}
+
+void UringEventHandler::send(int socket, void const* frame, size_t size, sockaddr_ll const& addr) {
+    if (free_send_slots.empty() || size > MAX_FRAME_SIZE) {
+        // every slot is in flight, fall back to a plain send
+        if (sendto(socket, frame, size, 0, (const sockaddr*)&addr, (socklen_t)sizeof(addr)) == -1) {
+            std::cout << "failed to send packet: " << strerror(errno) << std::endl;
+        }
+        return;
+    }
+    unsigned idx = free_send_slots.back();
+    free_send_slots.pop_back();
+    SendSlot& slot = send_slots[idx];
+    slot.addr = addr;
+    std::memcpy(slot.data.data(), frame, size);
+    slot.iov = {slot.data.data(), size};
+    slot.msg = {};
+    slot.msg.msg_name = &slot.addr;
+    slot.msg.msg_namelen = sizeof(slot.addr);
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socket;
+    sqe->addr = reinterpret_cast<uint64_t>(&slot.msg);
+    sqe->len = 1;
+    sqe->user_data = user_data(OP_SEND, idx);
+}
+
+void UringEventHandler::process_completion(io_uring_cqe const& cqe) {
+    uint64_t op = cqe.user_data >> 56;
+    size_t idx = cqe.user_data & ((1ull << 56) - 1);
+    if (op == OP_POLL) {
+        if (!polls[idx].f) return;
+        if (cqe.res < 0) {
+            std::cout << "warning: io_uring poll failed: " << strerror(-cqe.res) << std::endl;
+        } else {
+            (*polls[idx].f)(cqe.res);
+        }
+        if (polls[idx].f) arm_poll(idx);
+    } else if (op == OP_RECV) {
+        Receiver& receiver = *receiver_index[idx];
+        if (cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+            uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            unsigned char* buffer = recv_buffers.data() + bid * RECV_BUFFER_SIZE;
+            auto out = reinterpret_cast<io_uring_recvmsg_out*>(buffer);
+            auto name = reinterpret_cast<sockaddr_ll*>(buffer + sizeof(*out));
+            unsigned char* control = buffer + sizeof(*out) + receiver.msg.msg_namelen;
+            unsigned char* payload = control + receiver.msg.msg_controllen;
+            if (out->flags & MSG_TRUNC) {
+                std::cout << "warning: truncated frame: " << out->payloadlen << std::endl;
+            } else {
+                msghdr msg = {};
+                msg.msg_control = control;
+                msg.msg_controllen = out->controllen;
+                msg.msg_flags = out->flags;
+                (*receiver.f)(ReceivedFrame{payload, out->payloadlen, *name, msg});
+            }
+            recycle_buffer(bid);
+        } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+            std::cout << "warning: io_uring recvmsg failed: " << strerror(-cqe.res) << std::endl;
+        }
+        // the kernel ends multishot receives on errors and when it runs out of buffers
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            if (running) {
+                arm_receiver(idx);
+            } else {
+                --stopping_receivers;
+            }
+        }
+    } else if (op == OP_SEND) {
+        if (cqe.res < 0) {
+            std::cout << "failed to send packet: " << strerror(-cqe.res) << std::endl;
+        }
+        free_send_slots.push_back(idx);
+    }
+}
+
+void UringEventHandler::stop() {
+    if (!running) return;
+    running = false;
+    stopping_receivers = receiver_index.size();
+    for (size_t idx = 0; idx < receiver_index.size(); ++idx) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data(OP_RECV, idx);
+        sqe->user_data = user_data(OP_CANCEL, idx);
+    }
+}
+
+void UringEventHandler::handle_events() {
+    while (running || stopping_receivers > 0) {
+        // submits the replies queued while handling the last batch and waits for the next one
+        submit(1);
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            ++head;
+            // release the slot before the handler runs, it may queue more work
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            process_completion(cqe);
+            tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    // replies to the last frames
+    submit(0);
+}
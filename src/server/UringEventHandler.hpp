@@ -0,0 +1,90 @@
+#pragma once
+#include "EventHandler.hpp"
+#include <array>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <vector>
+
+// io_uring backend of the event loop.
+// Packet sockets are read with multishot recvmsg into a provided buffer ring, so a burst of frames needs no syscall per frame.
+// Replies are queued as sendmsg SQEs and submitted together with the next wait.
+// Other sockets and timers use poll SQEs on the same ring, so the handlers work the same as with epoll.
+class UringEventHandler : public EventHandler {
+  public:
+    UringEventHandler();
+    ~UringEventHandler();
+    void register_socket(int socket, std::function<void(uint32_t)>& f, uint32_t events = EPOLLIN) override;
+    void unregister_socket(int socket) override;
+    void register_receiver(int socket, std::function<void(ReceivedFrame const&)>& f) override;
+    void send(int socket, void const* frame, size_t size, sockaddr_ll const& addr) override;
+    void handle_events() override;
+    // cancels the receives and handles the frames they already read before returning
+    void stop() override;
+
+  private:
+    static constexpr unsigned RING_ENTRIES = 256;
+    static constexpr unsigned RECV_BUFFERS = 256;
+    static constexpr unsigned SEND_SLOTS = 64;
+    static constexpr uint16_t BUFFER_GROUP = 0;
+    // recvmsg_out header, name and control messages come before the frame in each buffer
+    static constexpr size_t RECV_BUFFER_SIZE = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_ll) + CONTROL_SIZE + MAX_FRAME_SIZE;
+
+    int ring_fd = -1;
+    // submission queue
+    void* sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned pending_submissions = 0;
+    // completion queue
+    void* cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    // provided buffers for multishot recvmsg
+    io_uring_buf_ring* buf_ring = nullptr;
+    size_t buf_ring_size = 0;
+    std::vector<unsigned char> recv_buffers;
+    uint16_t buf_tail = 0;
+    void recycle_buffer(uint16_t bid);
+
+    struct Poll {
+        int socket;
+        uint32_t events;
+        // nullptr once unregistered, the index is not reused so a late completion cannot reach another socket
+        std::function<void(uint32_t)>* f;
+    };
+    std::vector<Poll> polls;
+    struct Receiver {
+        int socket;
+        msghdr msg;
+        std::function<void(ReceivedFrame const&)>* f;
+        // the error queue is read with plain recvmsg when the socket reports EPOLLERR
+        std::function<void(uint32_t)> error_poll;
+    };
+    // receivers keep their msghdr alive for the kernel, so they must not move
+    std::list<Receiver> receivers;
+    std::vector<Receiver*> receiver_index;
+    // receives that still have to end after stop
+    size_t stopping_receivers = 0;
+    struct SendSlot {
+        sockaddr_ll addr;
+        iovec iov;
+        msghdr msg;
+        std::array<unsigned char, MAX_FRAME_SIZE> data;
+    };
+    std::vector<SendSlot> send_slots = std::vector<SendSlot>(SEND_SLOTS);
+    std::vector<unsigned> free_send_slots;
+
+    io_uring_sqe* get_sqe();
+    void submit(unsigned wait);
+    void arm_poll(size_t idx);
+    void arm_receiver(size_t idx);
+    void process_completion(io_uring_cqe const& cqe);
+};
@@ -1,10 +1,15 @@
 #include "common.hpp"
+#include "PrefixTable.hpp"
 #include <arpa/inet.h>
+#include <cctype>
+#include <cstdio>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <linux/filter.h>
 
+std::unordered_map<MAC, std::string> defaultEntries;
+
 // https://natanyellin.com/posts/ebpf-filtering-done-right/
 /*
 void drain_socket(int socket) {
@@ -46,6 +51,100 @@ bool parse_mac(std::istream& config, MAC& mac) {
     return false;
 }
 
+// reads up to 6 hex bytes separated by ':', separator is the character after the last byte
+static int read_mac_bytes(std::istream& config, MAC& mac, char& separator) {
+    mac = {};
+    char c[3] = {};
+    separator = 0;
+    int idx = 0;
+    while (idx < 6 && config.get(c[0]) && config.get(c[1]) && config.get(separator)) {
+        if (!isxdigit(c[0]) || !isxdigit(c[1])) {
+            return 0;
+        }
+        sscanf(c, "%2hhx", &mac[idx++]);
+        if (separator != ':') {
+            break;
+        }
+    }
+    return idx;
+}
+
+bool parse_mac_key(std::istream& config, MAC& first, MAC& last, uint16_t& vlan) {
+    vlan = 0;
+    char separator;
+    int idx = read_mac_bytes(config, first, separator);
+    if (separator == '-' && idx == 6) {
+        if (read_mac_bytes(config, last, separator) != 6 || mac_to_u64(first) > mac_to_u64(last)) {
+            return false;
+        }
+    } else if (separator == '/' && idx > 0) {
+        unsigned length;
+        if (!(config >> length) || length > 8u * idx) {
+            return false;
+        }
+        separator = config.get();
+        uint64_t host_mask = (1ull << (48 - length)) - 1;
+        uint64_t prefix = mac_to_u64(first) & ~host_mask;
+        for (size_t i = 0; i < first.size(); ++i) {
+            first[i] = (prefix >> (40 - 8 * i)) & 0xff;
+            last[i] = ((prefix | host_mask) >> (40 - 8 * i)) & 0xff;
+        }
+    } else if (idx == 6) {
+        last = first;
+    } else {
+        return false;
+    }
+
+    if (separator == '@') {
+        // 0 and 4095 are reserved VIDs
+        if (!(config >> vlan) || vlan == 0 || vlan > 4094) {
+            return false;
+        }
+        separator = config.get();
+    }
+    return separator == ' ';
+}
+
+std::string const* find_entry(MAC const& mac, uint16_t vlan) {
+    if (vlan != 0 && !vlanEntries.empty()) {
+        auto vlanIt = vlanEntries.find(vlan);
+        if (vlanIt != vlanEntries.end()) {
+            auto entryIt = vlanIt->second.exact.find(mac);
+            if (entryIt != vlanIt->second.exact.end()) {
+                return &entryIt->second;
+            }
+            if (std::string const* entry = vlanIt->second.prefixes.find(mac)) {
+                return entry;
+            }
+        }
+    }
+    auto entryIt = defaultEntries.find(mac);
+    if (entryIt != defaultEntries.end()) {
+        return &entryIt->second;
+    }
+    return prefixEntries.find(mac);
+}
+
+void write_entries(std::ostream& out) {
+    char mac_str[MAC_STR_SIZE];
+    for (auto const& [mac, entry] : defaultEntries) {
+        format_mac(mac, mac_str);
+        out << mac_str << " " << entry << "\n";
+    }
+    prefixEntries.write(out, 0);
+    for (auto const& [vlan, entries] : vlanEntries) {
+        for (auto const& [mac, entry] : entries.exact) {
+            format_mac(mac, mac_str);
+            out << mac_str << "@" << vlan << " " << entry << "\n";
+        }
+        entries.prefixes.write(out, vlan);
+    }
+}
+
+void format_mac(MAC const& mac, char (&str)[MAC_STR_SIZE]) {
+    snprintf(str, MAC_STR_SIZE, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
 void print_mac(MAC const& mac) {
     for (size_t i = 0; i < mac.size(); i++) {
         std::cout << std::hex << std::setw(2) << std::setfill('0') << (int)mac[i];
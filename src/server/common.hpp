@@ -1,6 +1,7 @@
 #pragma once
 #include <array>
 #include <istream>
+#include <ostream>
 #include <linux/filter.h>
 #include <net/ethernet.h>
 #include <unordered_map>
@@ -15,6 +16,16 @@ struct RequestFrame {
     ethhdr hdr;
 };
 
+// first payload byte of a request that carries the menu entries of the client, as in an export
+const uint8_t COMBINED_REQUEST = 0x01;
+
+// 802.1Q tag of a received frame, tpid is 0 for untagged frames
+struct VlanTag {
+    uint16_t tpid = 0;
+    uint16_t tci = 0;
+    uint16_t vid() const { return tci & 0x0fff; }
+};
+
 struct __attribute__((packed)) DataFrame {
     ethhdr hdr;
     uint8_t entry_length;
@@ -24,7 +35,22 @@ struct __attribute__((packed)) DataFrame {
 // void drain_socket(int socket);
 
 bool parse_mac(std::istream& config, MAC& mac);
+// parses an exact MAC, a prefix (0a:1b:2c/24) or a range (0a:1b:2c:00:00:00-0a:1b:2c:00:0f:ff)
+// followed by a space into the inclusive range [first, last],
+// a key ending with @vid (0a:1b:2c/24@10) only applies to frames tagged with that VLAN, vlan is 0 otherwise
+bool parse_mac_key(std::istream& config, MAC& first, MAC& last, uint16_t& vlan);
 void print_mac(MAC const& mac);
+// aa:bb:cc:dd:ee:ff and the null terminator
+const size_t MAC_STR_SIZE = 18;
+void format_mac(MAC const& mac, char (&str)[MAC_STR_SIZE]);
+
+inline uint64_t mac_to_u64(MAC const& mac) {
+    uint64_t v = 0;
+    for (auto b : mac) {
+        v = (v << 8) | b;
+    }
+    return v;
+}
 
 namespace std {
 template <> struct hash<MAC> {
@@ -39,3 +65,10 @@ template <> struct hash<MAC> {
 } // namespace std
 
 extern std::unordered_map<MAC, std::string> defaultEntries;
+
+// writes every entry in the config file format
+void write_entries(std::ostream& out);
+
+// entries of the VLAN are checked before the shared entries,
+// exact entries override prefix and range rules
+std::string const* find_entry(MAC const& mac, uint16_t vlan = 0);
@@ -1,24 +1,39 @@
 #include "ConfigHandler.hpp"
 #include "EventHandler.hpp"
+#include "LatencyTracer.hpp"
 #include "MQTTHandler.hpp"
+#include "PeerHandler.hpp"
+#include "RateLimiter.hpp"
 #include "RequestHandler.hpp"
+#include "UpgradeHandler.hpp"
+#include "UringEventHandler.hpp"
 #include "common.hpp"
+#include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <sched.h>
+#include <sys/mman.h>
 #include <unordered_map>
 
-std::unordered_map<MAC, std::string> defaultEntries;
-
 int main(int argc, char* argv[]) {
-    EventHandler eventHandler;
-    ConfigHandler configHandler(eventHandler);
     std::string ifname;
     std::string host;
     uint16_t port = 1883;
     std::string username;
     std::string password;
     std::string configFile;
+    uint64_t suppress_ms = 100;
+    uint64_t rate = 0;
+    uint64_t burst = 0;
+    uint32_t heartbeat_ms = 0;
+    std::string configSocket = "/tmp/remote-bootselect.sock";
+    std::string backend = "epoll";
+    int cpu = -1;
+    int busy_poll_us = 50;
+    size_t trace_records = 0;
+    std::string upgradeSocket;
     for (int i = 0; i + 1 < argc; i++) {
         std::string const& arg = argv[i];
         if (arg.compare("-i") == 0) {
@@ -33,19 +48,83 @@ int main(int argc, char* argv[]) {
             username = std::string(argv[++i]);
         } else if (arg.compare("-pass") == 0) {
             password = std::string(argv[++i]);
+        } else if (arg.compare("-suppress") == 0) {
+            suppress_ms = std::stoull(argv[++i]);
+        } else if (arg.compare("-rate") == 0) {
+            rate = std::stoull(argv[++i]);
+        } else if (arg.compare("-burst") == 0) {
+            burst = std::stoull(argv[++i]);
+        } else if (arg.compare("-ha") == 0) {
+            heartbeat_ms = std::stoul(argv[++i]);
+        } else if (arg.compare("-sock") == 0) {
+            configSocket = argv[++i];
+        } else if (arg.compare("-backend") == 0) {
+            backend = argv[++i];
+        } else if (arg.compare("-cpu") == 0) {
+            cpu = std::stoi(argv[++i]);
+        } else if (arg.compare("-busy_poll") == 0) {
+            busy_poll_us = std::stoi(argv[++i]);
+        } else if (arg.compare("-trace") == 0) {
+            trace_records = std::stoull(argv[++i]);
+        } else if (arg.compare("-upgrade") == 0) {
+            upgradeSocket = argv[++i];
         }
     }
 
+    // low latency mode, stdout gets a static buffer so logging on the request path does not allocate it
+    static char stdout_buffer[BUFSIZ];
+    if (cpu >= 0) {
+        setvbuf(stdout, stdout_buffer, _IOLBF, sizeof(stdout_buffer));
+    }
+
+    std::unique_ptr<EventHandler> eventHandler;
+    if (backend.compare("io_uring") == 0) {
+        eventHandler = std::make_unique<UringEventHandler>();
+    } else if (backend.compare("epoll") == 0) {
+        eventHandler = std::make_unique<EpollEventHandler>();
+    } else {
+        std::cout << "error: unknown event loop backend: " << backend << std::endl;
+        return 1;
+    }
+
+    // a process that is already running on the upgrade socket hands over its sockets and entries
+    UpgradeHandler::Handoff handoff;
+    if (upgradeSocket.size() > 0 && UpgradeHandler::receive_handoff(upgradeSocket, handoff)) {
+        std::cout << "taking over from the running process" << std::endl;
+    }
+
+    ConfigHandler configHandler(*eventHandler, configSocket, handoff.config_socket);
     if (ifname.size() == 0) {
         std::cout << "error: interface option missing" << std::endl;
     } else {
-        MQTTHandler mqttHandler(eventHandler, configHandler, host, port, username, password);
-        RequestHandler requestHandler(eventHandler, mqttHandler, ifname);
+        MQTTHandler mqttHandler(*eventHandler, configHandler, host, port, username, password);
+        RateLimiter rateLimiter(suppress_ms, rate, burst > 0 ? burst : rate);
+        RequestHandler requestHandler(*eventHandler, mqttHandler, rateLimiter, ifname, handoff.data_socket);
+        configHandler.register_command("stats", [&rateLimiter, &requestHandler]() { return rateLimiter.stats() + requestHandler.stats(); });
+        configHandler.register_command("mqtt", [&mqttHandler]() { return mqttHandler.stats(); });
+
+        std::unique_ptr<PeerHandler> peerHandler;
+        if (heartbeat_ms > 0) {
+            peerHandler = std::make_unique<PeerHandler>(*eventHandler, requestHandler, heartbeat_ms);
+            requestHandler.peerHandler = peerHandler.get();
+            configHandler.register_command("peers", [&peerHandler]() { return peerHandler->peers(); });
+        }
+
+        std::unique_ptr<LatencyTracer> tracer;
+        if (trace_records > 0) {
+            requestHandler.enable_timestamps();
+            tracer = std::make_unique<LatencyTracer>(trace_records);
+            requestHandler.tracer = tracer.get();
+            configHandler.register_command("trace", [&tracer](std::istream& args) { return tracer->trace_command(args); });
+            configHandler.register_command("latency", [&tracer]() { return tracer->latency(); });
+        }
 
         configHandler.mqttHandler = &mqttHandler;
-        mqttHandler.get_state(host, port, username, password);
 
-        if (configFile.size() > 0) {
+        if (handoff.connection != -1) {
+            // the entries of the running process include the config file and every change made since
+            UpgradeHandler::finish_handoff(handoff, configHandler);
+        } else if (configFile.size() > 0) {
             std::ifstream config(configFile, std::ios::in);
             if (config.is_open()) {
                 configHandler.process_config(config);
@@ -55,6 +134,30 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        eventHandler.handle_events();
+        // only created once the handoff is done, so a process that exits during the handoff does not take over the path
+        std::unique_ptr<UpgradeHandler> upgradeHandler;
+        if (upgradeSocket.size() > 0) {
+            upgradeHandler =
+                std::make_unique<UpgradeHandler>(*eventHandler, upgradeSocket, requestHandler.get_socket(), configHandler.get_socket());
+        }
+
+        // the mqtt thread is already running, so only the event loop is pinned
+        if (cpu >= 0) {
+            requestHandler.enable_busy_poll(busy_poll_us);
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+                std::cout << "warning: failed to pin to cpu " << cpu << ": " << strerror(errno) << std::endl;
+            }
+            if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+                std::cout << "warning: failed to lock memory: " << strerror(errno) << std::endl;
+            }
+        }
+
+        // requests are served from the local config while the broker connects in the background,
+        // the local changes are published first and the retained states are applied after that
+        mqttHandler.start();
+        eventHandler->handle_events();
     }
 }
@@ -0,0 +1,63 @@
+#include "src/server/ConfigHandler.hpp"
+#include "src/server/EventHandler.hpp"
+#include "src/server/PrefixTable.hpp"
+#include "src/server/common.hpp"
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+// Fails if a valid line of a config is lost because of the lines around it.
+
+class NullEventHandler : public EventHandler {
+  public:
+    void register_socket(int, std::function<void(uint32_t)>&, uint32_t) override {}
+    void unregister_socket(int) override {}
+    void register_receiver(int, std::function<void(ReceivedFrame const&)>&) override {}
+    void send(int, void const*, size_t, sockaddr_ll const&) override {}
+    void handle_events() override {}
+};
+
+static bool expect(MAC const& mac, uint16_t vlan, char const* expected) {
+    std::string const* entry = find_entry(mac, vlan);
+    if (entry && *entry == expected) return true;
+    char mac_str[MAC_STR_SIZE];
+    format_mac(mac, mac_str);
+    std::cout << "error: " << mac_str << "@" << vlan << " is " << (entry ? *entry : "missing") << ", expected " << expected << std::endl;
+    return false;
+}
+
+int main() {
+    std::string socket_path = "/tmp/remote-bootselect-test-" + std::to_string(getpid()) + ".sock";
+    NullEventHandler eventHandler;
+    ConfigHandler configHandler(eventHandler, socket_path);
+    unlink(socket_path.c_str());
+
+    std::stringstream config("0a:1b:2c:3d:4e:01 first\n"
+                             "\n"
+                             "0a:1b:2c:3d:4e:02 after_blank\n"
+                             "   \n"
+                             "0a:1b:2c:3d:4e:03 after_spaces\r\n"
+                             "not a mac\n"
+                             "0a:1b:2c:3d:4e:04 after_invalid\n"
+                             "\n"
+                             "\n"
+                             "0a:1b:2d:00:00:00/24 prefix\n"
+                             "\n"
+                             "0a:1b:2c:3d:4e:05@10 vlan\n"
+                             "0a:1b:2c:3d:4e:06 last");
+    configHandler.process_config(config, false);
+
+    bool ok = expect({0x0a, 0x1b, 0x2c, 0x3d, 0x4e, 0x01}, 0, "first");
+    ok &= expect({0x0a, 0x1b, 0x2c, 0x3d, 0x4e, 0x02}, 0, "after_blank");
+    ok &= expect({0x0a, 0x1b, 0x2c, 0x3d, 0x4e, 0x03}, 0, "after_spaces");
+    ok &= expect({0x0a, 0x1b, 0x2c, 0x3d, 0x4e, 0x04}, 0, "after_invalid");
+    ok &= expect({0x0a, 0x1b, 0x2d, 0x12, 0x34, 0x56}, 0, "prefix");
+    ok &= expect({0x0a, 0x1b, 0x2c, 0x3d, 0x4e, 0x05}, 10, "vlan");
+    ok &= expect({0x0a, 0x1b, 0x2c, 0x3d, 0x4e, 0x06}, 0, "last");
+    ok &= defaultEntries.size() == 5;
+    if (!ok) {
+        std::cout << "error: the config was not loaded as expected" << std::endl;
+        return 1;
+    }
+    std::cout << "config loaded" << std::endl;
+}
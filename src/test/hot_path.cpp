@@ -0,0 +1,156 @@
+#include "src/server/ConfigHandler.hpp"
+#include "src/server/EventHandler.hpp"
+#include "src/server/LatencyTracer.hpp"
+#include "src/server/MQTTHandler.hpp"
+#include "src/server/PrefixTable.hpp"
+#include "src/server/RateLimiter.hpp"
+#include "src/server/RequestHandler.hpp"
+#include "src/server/common.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Fails if handling a request frame allocates.
+// The frames are fed to RequestHandler through an event handler that records the receiver and the sends,
+// so the packet socket is never bound and the test can run in its own user and network namespace without privileges.
+
+static size_t allocations = 0;
+
+// malloc itself is interposed, so allocations of libc (stdio buffers, getaddrinfo, ...) are counted as well as operator new,
+// which allocates through malloc
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* p);
+
+void* malloc(size_t size) {
+    ++allocations;
+    return __libc_malloc(size);
+}
+void* calloc(size_t count, size_t size) {
+    ++allocations;
+    return __libc_calloc(count, size);
+}
+void* realloc(void* p, size_t size) {
+    ++allocations;
+    return __libc_realloc(p, size);
+}
+void* aligned_alloc(size_t alignment, size_t size) {
+    ++allocations;
+    return __libc_memalign(alignment, size);
+}
+int posix_memalign(void** p, size_t alignment, size_t size) {
+    ++allocations;
+    *p = __libc_memalign(alignment, size);
+    return *p ? 0 : ENOMEM;
+}
+void free(void* p) { __libc_free(p); }
+}
+
+class RecordingEventHandler : public EventHandler {
+  public:
+    void register_socket(int, std::function<void(uint32_t)>&, uint32_t) override {}
+    void unregister_socket(int) override {}
+    void register_receiver(int, std::function<void(ReceivedFrame const&)>& f) override { receiver = &f; }
+    void send(int, void const* frame, size_t size, sockaddr_ll const&) override {
+        ++sends;
+        if (size > sizeof(ethhdr) && static_cast<unsigned char const*>(frame)[12] == 0x81) ++tagged_sends;
+    }
+    void handle_events() override {}
+
+    std::function<void(ReceivedFrame const&)>* receiver = nullptr;
+    size_t sends = 0;
+    size_t tagged_sends = 0;
+};
+
+static void receive(RecordingEventHandler& eventHandler, MAC const& client, uint16_t vlan = 0, std::string const* payload = nullptr) {
+    unsigned char frame[60] = {};
+    ethhdr hdr = {};
+    std::memset(hdr.h_dest, 0xff, sizeof(hdr.h_dest));
+    std::memcpy(hdr.h_source, client.data(), client.size());
+    hdr.h_proto = htons(ETHERTYPE);
+    std::memcpy(frame, &hdr, sizeof(hdr));
+    if (payload) std::memcpy(frame + sizeof(hdr), payload->data(), payload->size());
+    sockaddr_ll from = {};
+    from.sll_pkttype = PACKET_BROADCAST;
+    msghdr msg = {};
+    alignas(cmsghdr) unsigned char control[CMSG_SPACE(sizeof(tpacket_auxdata))] = {};
+    if (vlan != 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_PACKET;
+        cmsg->cmsg_type = PACKET_AUXDATA;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(tpacket_auxdata));
+        tpacket_auxdata aux = {};
+        aux.tp_status = TP_STATUS_VLAN_VALID;
+        aux.tp_vlan_tci = vlan;
+        std::memcpy(CMSG_DATA(cmsg), &aux, sizeof(aux));
+    }
+    (*eventHandler.receiver)(ReceivedFrame{frame, sizeof(frame), from, msg});
+}
+
+// an unbound packet socket, which receives nothing
+static int packet_socket() {
+    int data_socket = socket(AF_PACKET, SOCK_RAW, 0);
+    if (data_socket == -1 && errno == EPERM && unshare(CLONE_NEWUSER | CLONE_NEWNET) == 0) {
+        data_socket = socket(AF_PACKET, SOCK_RAW, 0);
+    }
+    return data_socket;
+}
+
+int main() {
+    int data_socket = packet_socket();
+    if (data_socket == -1) {
+        std::cout << "skipped: no packet socket: " << strerror(errno) << std::endl;
+        return 77;
+    }
+    std::string socket_path = "/tmp/remote-bootselect-test-" + std::to_string(getpid()) + ".sock";
+    RecordingEventHandler eventHandler;
+    ConfigHandler configHandler(eventHandler, socket_path);
+    MQTTHandler mqttHandler(eventHandler, configHandler, "", 0, "", "");
+    RateLimiter rateLimiter(0, 1000, 1000);
+    RequestHandler requestHandler(eventHandler, mqttHandler, rateLimiter, "lo", data_socket);
+    LatencyTracer tracer(64);
+    requestHandler.tracer = &tracer;
+
+    MAC exact = {0x0a, 0x1b, 0x2c, 0x3d, 0x4e, 0x5f};
+    MAC prefix = {0x0a, 0x1b, 0x2d, 0x00, 0x00, 0x01};
+    MAC miss = {0x0a, 0x1b, 0x2e, 0x00, 0x00, 0x01};
+    defaultEntries[exact] = "linux";
+    prefixEntries.insert({0x0a, 0x1b, 0x2d, 0x00, 0x00, 0x00}, {0x0a, 0x1b, 0x2d, 0xff, 0xff, 0xff}, "windows");
+    prefixEntries.build();
+    vlanEntries[10].exact[miss] = "installer";
+
+    // a combined request carrying the menu of the client
+    std::string combined("\x01linux\0Linux\0windows\0Windows\0", 30);
+
+    // the first log line allocates the stdout buffer, the first combined request stores the menu
+    receive(eventHandler, miss);
+    receive(eventHandler, exact, 0, &combined);
+
+    size_t before = allocations;
+    for (int i = 0; i < 100; ++i) {
+        receive(eventHandler, exact);
+        receive(eventHandler, prefix);
+        receive(eventHandler, miss);
+        receive(eventHandler, miss, 10);
+        receive(eventHandler, exact, 0, &combined);
+    }
+    size_t allocated = allocations - before;
+    unlink(socket_path.c_str());
+
+    std::cout << "replies: " << eventHandler.sends << ", tagged: " << eventHandler.tagged_sends << ", allocations: " << allocated
+              << std::endl;
+    if (allocated != 0 || eventHandler.sends != 401 || eventHandler.tagged_sends != 100) {
+        std::cout << "error: the request path allocated or did not reply" << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,132 @@
+#include "src/server/ConfigHandler.hpp"
+#include "src/server/MQTTHandler.hpp"
+#include "src/server/PrefixTable.hpp"
+#include "src/server/RateLimiter.hpp"
+#include "src/server/RequestHandler.hpp"
+#include "src/server/UringEventHandler.hpp"
+#include "src/server/common.hpp"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <net/if.h>
+#include <poll.h>
+#include <set>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+// Request/reply round trips through the io_uring backend on the loopback interface.
+// The requests come in bursts, so the multishot receive runs through the provided buffers several times
+// and the replies of a burst are sent as one batch.
+// Skipped (exit 77) without CAP_NET_RAW or when the kernel has no io_uring with provided buffer rings.
+
+static constexpr int SKIP = 77;
+static constexpr size_t BURSTS = 20;
+static constexpr size_t BURST_SIZE = 64;
+
+// the backend exits when it cannot set up its ring, so it is tried in a child first
+static bool uring_supported() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        UringEventHandler eventHandler;
+        _exit(0);
+    }
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// sends the requests of every client in bursts and returns the number of clients that got a reply
+static size_t run_client(int client, int ifindex) {
+    size_t answered = 0;
+    for (size_t burst = 0; burst < BURSTS; ++burst) {
+        std::set<MAC> waiting;
+        for (size_t i = 0; i < BURST_SIZE; ++i) {
+            MAC mac = {0x0a, 0x1b, 0x2c, 0x00, static_cast<uint8_t>(burst), static_cast<uint8_t>(i)};
+            RequestFrame request = {};
+            std::memset(request.hdr.h_dest, 0xff, sizeof(request.hdr.h_dest));
+            std::memcpy(request.hdr.h_source, mac.data(), mac.size());
+            request.hdr.h_proto = htons(ETHERTYPE);
+            sockaddr_ll addr = {};
+            addr.sll_family = AF_PACKET;
+            addr.sll_ifindex = ifindex;
+            addr.sll_halen = ETH_ALEN;
+            std::memset(addr.sll_addr, 0xff, ETH_ALEN);
+            if (sendto(client, &request, sizeof(request), 0, (sockaddr*)&addr, sizeof(addr)) == -1) {
+                std::cout << "error: failed to send request: " << strerror(errno) << std::endl;
+            }
+            waiting.insert(mac);
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (!waiting.empty() && std::chrono::steady_clock::now() < deadline) {
+            pollfd fd = {client, POLLIN, 0};
+            if (poll(&fd, 1, 100) <= 0) continue;
+            unsigned char frame[EventHandler::MAX_FRAME_SIZE];
+            sockaddr_ll from = {};
+            socklen_t from_len = sizeof(from);
+            ssize_t size = recvfrom(client, frame, sizeof(frame), 0, (sockaddr*)&from, &from_len);
+            if (size <= static_cast<ssize_t>(sizeof(ethhdr)) || from.sll_pkttype == PACKET_OUTGOING) continue;
+            MAC dest;
+            std::memcpy(dest.data(), frame, dest.size());
+            // a reply carries the entry, the requests of other clients are looped back as well
+            if (frame[sizeof(ethhdr)] == 5 && std::memcmp(frame + sizeof(ethhdr) + 1, "linux", 5) == 0) {
+                answered += waiting.erase(dest);
+            }
+        }
+    }
+    return answered;
+}
+
+int main() {
+    int client = socket(AF_PACKET, SOCK_RAW, htons(ETHERTYPE));
+    if (client == -1) {
+        std::cout << "skipped: no packet socket: " << strerror(errno) << std::endl;
+        return SKIP;
+    }
+    if (!uring_supported()) {
+        std::cout << "skipped: io_uring backend is not supported" << std::endl;
+        return SKIP;
+    }
+    int ifindex = if_nametoindex("lo");
+    sockaddr_ll bind_addr = {};
+    bind_addr.sll_family = AF_PACKET;
+    bind_addr.sll_protocol = htons(ETHERTYPE);
+    bind_addr.sll_ifindex = ifindex;
+    if (bind(client, (sockaddr*)&bind_addr, sizeof(bind_addr)) == -1) {
+        std::cout << "error: failed to bind client socket: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    std::string socket_path = "/tmp/remote-bootselect-test-" + std::to_string(getpid()) + ".sock";
+    UringEventHandler eventHandler;
+    ConfigHandler configHandler(eventHandler, socket_path);
+    unlink(socket_path.c_str());
+    MQTTHandler mqttHandler(eventHandler, configHandler, "", 0, "", "");
+    RateLimiter rateLimiter(0, 1000000, 1000000);
+    RequestHandler requestHandler(eventHandler, mqttHandler, rateLimiter, "lo");
+    prefixEntries.insert({0x0a, 0x1b, 0x2c, 0x00, 0x00, 0x00}, {0x0a, 0x1b, 0x2c, 0x00, 0xff, 0xff}, "linux");
+    prefixEntries.build();
+
+    // the event loop is stopped from its own thread once the client is done
+    int done_fd = eventfd(0, EFD_NONBLOCK);
+    std::function<void(uint32_t)> done = [&](uint32_t) { eventHandler.stop(); };
+    eventHandler.register_socket(done_fd, done);
+
+    size_t answered = 0;
+    std::thread clientThread([&]() {
+        answered = run_client(client, ifindex);
+        uint64_t wake = 1;
+        write(done_fd, &wake, sizeof(wake));
+    });
+    eventHandler.handle_events();
+    clientThread.join();
+    close(done_fd);
+    close(client);
+
+    std::cout << "answered: " << answered << " of " << BURSTS * BURST_SIZE << std::endl;
+    if (answered != BURSTS * BURST_SIZE) {
+        std::cout << "error: the io_uring backend did not answer every request" << std::endl;
+        return 1;
+    }
+}